@@ -0,0 +1,45 @@
+﻿#include "arena.h"
+
+#include <algorithm>
+
+static size_t align_up(const size_t offset, const std::byte* base, const size_t alignment) {
+    const auto address = reinterpret_cast<uintptr_t>(base) + offset;
+    return offset + (-address & (alignment - 1));
+}
+
+void* Arena::do_allocate(const size_t bytes, const size_t alignment) {
+    for (; mCurrent < mBlocks.size(); ++mCurrent, mOffset = 0) {
+        Block &block = mBlocks[mCurrent];
+        const size_t start = align_up(mOffset, block.data.get(), alignment);
+        if (start + bytes <= block.size) {
+            mOffset = start + bytes;
+            return block.data.get() + start;
+        }
+    }
+
+    const size_t size = std::max({bytes + alignment, INITIAL_BLOCK_SIZE,
+                                  mBlocks.empty() ? 0 : mBlocks.back().size * 2});
+    mBlocks.push_back({std::make_unique_for_overwrite<std::byte[]>(size), size});
+    mCurrent = mBlocks.size() - 1;
+    const size_t start = align_up(0, mBlocks.back().data.get(), alignment);
+    mOffset = start + bytes;
+    return mBlocks.back().data.get() + start;
+}
+
+// A compilation that outgrew the first block leaves several; they are merged
+// into one so the next compilation of that size bumps through a single block.
+void Arena::reset() {
+    if (mBlocks.size() > 1) {
+        const size_t size = capacity();
+        mBlocks.clear();
+        mBlocks.push_back({std::make_unique_for_overwrite<std::byte[]>(size), size});
+    }
+    mCurrent = 0;
+    mOffset = 0;
+}
+
+size_t Arena::capacity() const {
+    size_t size = 0;
+    for (const Block &block : mBlocks) size += block.size;
+    return size;
+}
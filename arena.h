@@ -0,0 +1,39 @@
+﻿#pragma once
+
+#include <memory>
+#include <memory_resource>
+#include <vector>
+
+#include "common.h"
+
+// Bump allocator for everything one compilation needs. deallocate() is a
+// no-op and reset() hands all memory back in O(1) without freeing it, so once
+// a compilation of some size has been seen, later ones of that size make no
+// calls to the global allocator. Not thread-safe.
+class Arena final : public std::pmr::memory_resource {
+    static constexpr size_t INITIAL_BLOCK_SIZE = 16 * 1024;
+
+    struct Block {
+        std::unique_ptr<std::byte[]> data;
+        size_t size;
+    };
+
+    std::vector<Block> mBlocks;
+    size_t mCurrent = 0; // block being bumped
+    size_t mOffset = 0; // bytes used in mBlocks[mCurrent]
+
+    void* do_allocate(size_t bytes, size_t alignment) override;
+    void do_deallocate(void*, size_t, size_t) override {}
+    [[nodiscard]] bool do_is_equal(const memory_resource &other) const noexcept override {
+        return this == &other;
+    }
+
+public:
+    Arena() = default;
+    Arena(const Arena &) = delete;
+    Arena &operator=(const Arena &) = delete;
+
+    // Everything allocated so far becomes invalid.
+    void reset();
+    [[nodiscard]] size_t capacity() const;
+};
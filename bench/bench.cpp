@@ -0,0 +1,346 @@
+﻿// hex_bench: per-stage microbenchmarks and an end-to-end mode.
+//
+//   hex_bench [--no-fold] [--peephole] [--registers] [--bulk-scan] [--repeat N] [--json PATH] [script...]
+//
+// Each script (default: every file in the corpus directory) is measured as
+// scan (Scanner::scan_token until EOF), tokenize (walking a TokenBuffer),
+// compile (VM::compile into a recycled Chunk), run (VM::execute of one
+// compiled chunk), jit (the same chunk as native code, JIT builds only), e2e
+// (VM::interpret) and cached (VM::interpret hitting the chunk cache).
+// Scripts that read inputs also get rows (VM::execute once per row over
+// BATCH_ROWS rows of inputs) and batch (VM::execute_batch over the same
+// columns); their units are rows.
+// Every benchmark takes N samples after calibrating the iteration count,
+// and reports median/mean/stddev/min ns per iteration, heap bytes per
+// iteration and, where it applies, ns per instruction and instructions per
+// second. A summary goes to stderr and JSON to PATH or stdout.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <new>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include "vm.h"
+
+static std::atomic<size_t> allocatedBytes{0};
+
+void* operator new(const size_t size) {
+    allocatedBytes.fetch_add(size, std::memory_order_relaxed);
+    if (void* pointer = std::malloc(size == 0 ? 1 : size)) return pointer;
+    throw std::bad_alloc();
+}
+
+void* operator new[](const size_t size) {
+    return operator new(size);
+}
+
+// The deletes stay out of line: once GCC inlines them down to free() it
+// pairs that with the operator new call site and warns about a mismatched
+// deallocation (-Wmismatched-new-delete), though both sides are ours.
+[[gnu::noinline]] void operator delete(void* pointer) noexcept {
+    std::free(pointer);
+}
+
+[[gnu::noinline]] void operator delete[](void* pointer) noexcept {
+    std::free(pointer);
+}
+
+[[gnu::noinline]] void operator delete(void* pointer, size_t) noexcept {
+    std::free(pointer);
+}
+
+[[gnu::noinline]] void operator delete[](void* pointer, size_t) noexcept {
+    std::free(pointer);
+}
+
+struct Result {
+    std::string benchmark;
+    std::string script;
+    size_t iterations;
+    double medianNs;
+    double meanNs;
+    double stddevNs;
+    double minNs;
+    double bytesPerIteration;
+    size_t units;           // tokens for scan, executed instructions otherwise
+};
+
+using Clock = std::chrono::steady_clock;
+
+static constexpr auto SAMPLE_TARGET = std::chrono::milliseconds(20);
+
+template <typename Body>
+static Result measure(const std::string &benchmark, const std::string &script, const int repeat, Body &&body) {
+    // grow the iteration count until one sample takes long enough to time
+    size_t iterations = 1;
+    for (;;) {
+        const auto start = Clock::now();
+        for (size_t i = 0; i < iterations; ++i) body();
+        if (Clock::now() - start >= SAMPLE_TARGET || iterations >= (1u << 24)) break;
+        iterations *= 2;
+    }
+
+    std::vector<double> samples;
+    size_t bytes = 0;
+    for (int r = 0; r < repeat; ++r) {
+        const size_t allocatedBefore = allocatedBytes.load(std::memory_order_relaxed);
+        const auto start = Clock::now();
+        for (size_t i = 0; i < iterations; ++i) body();
+        const auto elapsed = std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+        bytes += allocatedBytes.load(std::memory_order_relaxed) - allocatedBefore;
+        samples.push_back(elapsed / static_cast<double>(iterations));
+    }
+
+    std::sort(samples.begin(), samples.end());
+    double mean = 0;
+    for (const double sample : samples) mean += sample;
+    mean /= static_cast<double>(samples.size());
+    double variance = 0;
+    for (const double sample : samples) variance += (sample - mean) * (sample - mean);
+    variance /= static_cast<double>(samples.size());
+
+    const size_t middle = samples.size() / 2;
+    const double median = samples.size() % 2 ? samples[middle] : (samples[middle - 1] + samples[middle]) / 2;
+
+    return {
+        benchmark, script, iterations,
+        median, mean, std::sqrt(variance), samples.front(),
+        static_cast<double>(bytes) / static_cast<double>(iterations * repeat),
+        0,
+    };
+}
+
+// Instructions in a chunk; the bytecode has no jumps, so this is also the
+// number executed per run.
+static size_t count_instructions(const Chunk &chunk) {
+    const ChunkView view = chunk.view();
+    size_t count = 0;
+    for (size_t offset = 0; offset < view.codeSize; ++count) {
+        if (view.format == ChunkFormat::REGISTER)
+            offset += register_instruction_size(static_cast<RegOpCode>(view.code[offset]));
+        else
+            offset += instruction_size(static_cast<OpCode>(view.code[offset]));
+    }
+    return count;
+}
+
+static constexpr size_t BATCH_ROWS = 4096;
+
+// Evaluates the chunk over BATCH_ROWS rows, once row by row and once as
+// columns, and checks that both agree.
+static void bench_rows(VM &vm, const Chunk &compiled, const std::string &script, const int repeat,
+                       std::vector<Result> &results) {
+    const auto inputCount = static_cast<size_t>(compiled.get_input_count());
+    std::vector<std::vector<double>> columns(inputCount, std::vector<double>(BATCH_ROWS));
+    std::vector<const double*> columnPointers;
+    for (size_t k = 0; k < inputCount; ++k) {
+        for (size_t i = 0; i < BATCH_ROWS; ++i)
+            columns[k][i] = static_cast<double>((i * 7919 + k * 104729) % 1000) / 16 - 20;
+        columnPointers.push_back(columns[k].data());
+    }
+    const ChunkView view = compiled.view();
+
+    std::vector<Value> row(inputCount);
+    std::vector<double> scalarResults(BATCH_ROWS);
+    const std::span<const Value> inputs = vm.mInputs;
+    vm.mInputs = row;
+    Result rows = measure("rows", script, repeat, [&] {
+        for (size_t i = 0; i < BATCH_ROWS; ++i) {
+            for (size_t k = 0; k < inputCount; ++k)
+                row[k] = Value::checked_number(columns[k][i]);
+            vm.execute(view);
+            scalarResults[i] = vm.mResult.as_number();
+        }
+    });
+    rows.units = BATCH_ROWS;
+    results.push_back(rows);
+    vm.mInputs = inputs;
+
+    std::vector<double> batchResults(BATCH_ROWS);
+    Result batch = measure("batch", script, repeat, [&] {
+        vm.execute_batch(view, columnPointers, BATCH_ROWS, batchResults.data());
+    });
+    batch.units = BATCH_ROWS;
+    results.push_back(batch);
+
+    for (size_t i = 0; i < BATCH_ROWS; ++i) {
+        if (!same_result(Value::number(scalarResults[i]), Value::number(batchResults[i]))) {
+            std::fprintf(stderr, "%s: batch result of row %zu differs from the scalar loop\n", script.c_str(), i);
+            break;
+        }
+    }
+}
+
+static void bench_script(VM &vm, const std::filesystem::path &path, const int repeat, std::vector<Result> &results) {
+    std::ifstream fileStream(path);
+    std::stringstream buffer;
+    buffer << fileStream.rdbuf();
+    const std::string source = buffer.str();
+    const std::string script = path.filename().string();
+
+    size_t tokens = 0;
+    for (Scanner scanner(source); scanner.scan_token().type != TokenType::END_OF_FILE;) ++tokens;
+
+    Chunk compiled;
+    if (!vm.compile(source, &compiled)) {
+        std::fprintf(stderr, "%s: compile error, skipped\n", script.c_str());
+        return;
+    }
+    // the single-run stages see every input as 1.5
+    const std::vector<Value> inputs(compiled.get_input_count(), Value::number(1.5));
+    vm.mInputs = inputs;
+    const size_t instructions = count_instructions(compiled);
+    const ChunkView view = compiled.view();
+
+    Result scan = measure("scan", script, repeat, [&] {
+        Scanner scanner(source);
+        while (scanner.scan_token().type != TokenType::END_OF_FILE) {}
+    });
+    scan.units = tokens;
+    results.push_back(scan);
+
+    Arena arena;
+    Result tokenize = measure("tokenize", script, repeat, [&] {
+        arena.reset();
+        TokenBuffer buffer(source, &arena);
+        for (size_t i = 0; buffer.at(i).type != TokenType::END_OF_FILE; ++i) {}
+    });
+    tokenize.units = tokens;
+    results.push_back(tokenize);
+
+    Chunk chunk;
+    Result compile = measure("compile", script, repeat, [&] {
+        chunk.clear();
+        (void) vm.compile(source, &chunk);
+    });
+    compile.units = instructions;
+    results.push_back(compile);
+
+    Result run = measure("run", script, repeat, [&] {
+        vm.execute(view);
+    });
+    run.units = instructions;
+    results.push_back(run);
+
+#ifdef JIT
+    vm.mJit = true;
+    Result jit = measure("jit", script, repeat, [&] {
+        vm.execute(view);
+    });
+    jit.units = instructions;
+    results.push_back(jit);
+    vm.mJit = false;
+#endif
+
+    Result e2e = measure("e2e", script, repeat, [&] {
+        vm.interpret(source);
+    });
+    e2e.units = instructions;
+    results.push_back(e2e);
+
+    vm.mChunkCache.set_capacity(1);
+    Result cached = measure("cached", script, repeat, [&] {
+        vm.interpret(source);
+    });
+    cached.units = instructions;
+    results.push_back(cached);
+    vm.mChunkCache.set_capacity(0);
+
+    if (compiled.get_input_count() > 0)
+        bench_rows(vm, compiled, script, repeat, results);
+    vm.mInputs = {};
+}
+
+static void write_json(FILE* out, const VM &vm, const std::vector<Result> &results) {
+    std::fprintf(out, "{\n  \"fold\": %s,\n  \"peephole\": %s,\n  \"registers\": %s,\n  \"bulk_scan\": %s,\n"
+                      "  \"results\": [\n",
+                 vm.mParser.mFoldConstants ? "true" : "false",
+                 vm.mPeephole ? "true" : "false",
+                 vm.mParser.mRegisterMode ? "true" : "false",
+                 vm.mParser.mBulkScan ? "true" : "false");
+    for (size_t i = 0; i < results.size(); ++i) {
+        const Result &result = results[i];
+        std::fprintf(out,
+                     "    {\"benchmark\": \"%s\", \"script\": \"%s\", \"iterations\": %zu, "
+                     "\"median_ns\": %.1f, \"mean_ns\": %.1f, \"stddev_ns\": %.1f, \"min_ns\": %.1f, "
+                     "\"bytes_per_iteration\": %.1f, \"units\": %zu, \"ns_per_unit\": %.3f, \"units_per_sec\": %.0f}%s\n",
+                     result.benchmark.c_str(), result.script.c_str(), result.iterations,
+                     result.medianNs, result.meanNs, result.stddevNs, result.minNs,
+                     result.bytesPerIteration, result.units,
+                     result.units ? result.medianNs / static_cast<double>(result.units) : 0.0,
+                     result.units ? static_cast<double>(result.units) * 1e9 / result.medianNs : 0.0,
+                     i + 1 < results.size() ? "," : "");
+    }
+    std::fprintf(out, "  ]\n}\n");
+}
+
+int main(int argc, char *argv[]) {
+    int repeat = 10;
+    const char* jsonPath = nullptr;
+    std::vector<std::filesystem::path> scripts;
+    VM vm;
+
+    for (int i = 1; i < argc; ++i) {
+        const std::string_view arg = argv[i];
+        if (arg == "--no-fold")
+            vm.mParser.mFoldConstants = false;
+        else if (arg == "--peephole")
+            vm.mPeephole = true;
+        else if (arg == "--registers")
+            vm.mParser.mRegisterMode = true;
+        else if (arg == "--bulk-scan")
+            vm.mParser.mBulkScan = true;
+        else if (arg == "--repeat" && i + 1 < argc)
+            repeat = std::max(1, std::atoi(argv[++i]));
+        else if (arg == "--json" && i + 1 < argc)
+            jsonPath = argv[++i];
+        else if (!arg.starts_with("--"))
+            scripts.emplace_back(argv[i]);
+        else {
+            std::fprintf(stderr, "Usage: hex_bench [--no-fold] [--peephole] [--registers] [--bulk-scan] "
+                                 "[--repeat N] [--json PATH] [script...]\n");
+            return 64;
+        }
+    }
+
+    if (scripts.empty()) {
+        for (const auto &entry : std::filesystem::directory_iterator(HEX_BENCH_CORPUS))
+            if (entry.path().extension() == ".hex") scripts.push_back(entry.path());
+        std::sort(scripts.begin(), scripts.end());
+    }
+
+    // the VM prints every result; keep the report stream and silence the rest
+    FILE* report = jsonPath ? std::fopen(jsonPath, "w") : fdopen(dup(fileno(stdout)), "w");
+    if (report == nullptr) {
+        std::fprintf(stderr, "Could not open \"%s\".\n", jsonPath);
+        return 74;
+    }
+    std::fflush(stdout);
+    if (std::freopen("/dev/null", "w", stdout) == nullptr) return 74;
+
+    std::vector<Result> results;
+    for (const auto &script : scripts)
+        bench_script(vm, script, repeat, results);
+
+    std::fprintf(stderr, "%-8s %-12s %12s %10s %12s %12s\n", "bench", "script", "median ns", "stddev", "ns/unit", "bytes/iter");
+    for (const Result &result : results)
+        std::fprintf(stderr, "%-8s %-12s %12.0f %9.1f%% %12.2f %12.0f\n",
+                     result.benchmark.c_str(), result.script.c_str(), result.medianNs,
+                     100 * result.stddevNs / result.meanNs,
+                     result.units ? result.medianNs / static_cast<double>(result.units) : 0.0,
+                     result.bytesPerIteration);
+
+    write_json(report, vm, results);
+    std::fclose(report);
+    return 0;
+}
@@ -0,0 +1,140 @@
+﻿#include "bytecode_file.h"
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// FNV-1a, 64-bit
+static uint64_t checksum(const uint8_t* bytes, const size_t size, uint64_t hash = 14695981039346656037ull) {
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+static bool write_all(const int fd, const uint8_t* bytes, size_t size) {
+    while (size > 0) {
+        const ssize_t written = ::write(fd, bytes, size);
+        if (written < 0) return false;
+        bytes += written;
+        size -= static_cast<size_t>(written);
+    }
+    return true;
+}
+
+bool stamp_source(const char* path, const uint8_t options, SourceStamp *stamp) {
+    struct stat info{};
+    if (stat(path, &info) != 0) return false;
+
+    stamp->mtime = static_cast<int64_t>(info.st_mtim.tv_sec) * 1000000000 + info.st_mtim.tv_nsec;
+    stamp->size = static_cast<uint64_t>(info.st_size);
+    stamp->options = options;
+    return true;
+}
+
+bool write_bytecode_file(const char* path, const Chunk &chunk, const SourceStamp &stamp) {
+    const ChunkView view = chunk.view();
+
+    const auto* constants = reinterpret_cast<const uint8_t*>(view.constants);
+    const size_t constantBytes = view.constantCount * sizeof(Value);
+    const auto* lines = reinterpret_cast<const uint8_t*>(view.lines);
+    const size_t lineBytes = view.lineCount * sizeof(LineStart);
+
+    BytecodeHeader header{};
+    std::memcpy(header.magic, BYTECODE_MAGIC, sizeof(header.magic));
+    header.version = BYTECODE_VERSION;
+    header.format = static_cast<uint8_t>(view.format);
+    header.options = stamp.options;
+    header.codeSize = static_cast<uint32_t>(view.codeSize);
+    header.constantCount = static_cast<uint32_t>(view.constantCount);
+    header.lineCount = static_cast<uint32_t>(view.lineCount);
+    header.maxStackDepth = view.maxStackDepth;
+    header.inputCount = view.inputCount;
+    header.sourceMtime = stamp.mtime;
+    header.sourceSize = stamp.size;
+    header.checksum = checksum(view.code, view.codeSize, checksum(lines, lineBytes, checksum(constants, constantBytes)));
+
+    // write beside the target and rename, so concurrent readers never map a
+    // half-written file; mkstemp gives every writer its own temporary, even
+    // batch workers of one process writing the same path
+    std::string temporary = std::string(path) + ".tmpXXXXXX";
+    const int fd = mkstemp(temporary.data());
+    if (fd < 0) return false;
+
+    const bool written = fchmod(fd, 0644) == 0 &&
+                         write_all(fd, reinterpret_cast<const uint8_t*>(&header), sizeof(header)) &&
+                         write_all(fd, constants, constantBytes) &&
+                         write_all(fd, lines, lineBytes) &&
+                         write_all(fd, view.code, view.codeSize);
+    if (close(fd) != 0 || !written || std::rename(temporary.c_str(), path) != 0) {
+        std::remove(temporary.c_str());
+        return false;
+    }
+    return true;
+}
+
+MappedChunk::~MappedChunk() {
+    if (mpMapping != nullptr)
+        munmap(mpMapping, mSize);
+}
+
+bool MappedChunk::open(const char* path, const SourceStamp &expected) {
+    if (mpMapping != nullptr) {
+        munmap(mpMapping, mSize);
+        mpMapping = nullptr;
+    }
+
+    const int fd = ::open(path, O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat info{};
+    if (fstat(fd, &info) != 0 || static_cast<size_t>(info.st_size) < sizeof(BytecodeHeader)) {
+        close(fd);
+        return false;
+    }
+
+    mSize = static_cast<size_t>(info.st_size);
+    mpMapping = mmap(nullptr, mSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mpMapping == MAP_FAILED) {
+        mpMapping = nullptr;
+        return false;
+    }
+
+    const auto* bytes = static_cast<const uint8_t*>(mpMapping);
+    const auto* header = reinterpret_cast<const BytecodeHeader*>(bytes);
+
+    if (std::memcmp(header->magic, BYTECODE_MAGIC, sizeof(header->magic)) != 0
+        || header->version != BYTECODE_VERSION
+        || header->options != expected.options
+        || header->sourceMtime != expected.mtime
+        || header->sourceSize != expected.size
+        || header->format > static_cast<uint8_t>(ChunkFormat::REGISTER))
+        return false;
+
+    const size_t constantBytes = header->constantCount * sizeof(Value);
+    const size_t lineBytes = header->lineCount * sizeof(LineStart);
+    const size_t payload = constantBytes + lineBytes + header->codeSize;
+    if (mSize != sizeof(BytecodeHeader) + payload || header->codeSize == 0)
+        return false;
+
+    const uint8_t* constants = bytes + sizeof(BytecodeHeader);
+    const uint8_t* lines = constants + constantBytes;
+    const uint8_t* code = lines + lineBytes;
+    if (checksum(code, header->codeSize, checksum(lines, lineBytes, checksum(constants, constantBytes))) != header->checksum)
+        return false;
+
+    mView = {
+        code, header->codeSize,
+        reinterpret_cast<const Value*>(constants), header->constantCount,
+        reinterpret_cast<const LineStart*>(lines), header->lineCount,
+        header->maxStackDepth, static_cast<ChunkFormat>(header->format), header->inputCount,
+    };
+    return true;
+}
@@ -0,0 +1,56 @@
+﻿#pragma once
+
+#include "chunk.h"
+
+// On-disk layout, all native-endian and 8-byte aligned:
+//   BytecodeHeader | constants (Value[]) | lines (LineStart[]) | code (uint8_t[])
+// The checksum covers everything after the header.
+struct BytecodeHeader {
+    char magic[4];
+    uint16_t version;
+    uint8_t format;
+    uint8_t options;        // compiler flags the chunk was built with
+    uint32_t codeSize;
+    uint32_t constantCount;
+    uint32_t lineCount;
+    int32_t maxStackDepth;
+    int32_t inputCount;
+    int32_t reserved;
+    int64_t sourceMtime;    // nanoseconds
+    uint64_t sourceSize;
+    uint64_t checksum;
+};
+
+static_assert(sizeof(BytecodeHeader) % alignof(Value) == 0);
+
+inline constexpr char BYTECODE_MAGIC[4] = {'H', 'E', 'X', 'B'};
+inline constexpr uint16_t BYTECODE_VERSION = 2;
+
+// Identifies the source a cache file was compiled from; a cached chunk is
+// only used when all of it matches.
+struct SourceStamp {
+    int64_t mtime;
+    uint64_t size;
+    uint8_t options;
+};
+
+[[nodiscard]] bool stamp_source(const char* path, uint8_t options, SourceStamp *stamp);
+[[nodiscard]] bool write_bytecode_file(const char* path, const Chunk &chunk, const SourceStamp &stamp);
+
+// A bytecode file mapped read-only. view() points straight into the
+// mapping, so the VM executes it without copying.
+class MappedChunk {
+    void* mpMapping = nullptr;
+    size_t mSize = 0;
+    ChunkView mView{};
+
+public:
+    MappedChunk() = default;
+    MappedChunk(const MappedChunk &) = delete;
+    MappedChunk &operator=(const MappedChunk &) = delete;
+    ~MappedChunk();
+
+    // Fails on a missing, truncated, stale or corrupt file.
+    [[nodiscard]] bool open(const char* path, const SourceStamp &expected);
+    [[nodiscard]] const ChunkView &view() const { return mView; }
+};
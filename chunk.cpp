@@ -1,15 +1,169 @@
 ﻿#include "chunk.h"
 
+#include <algorithm>
+#include <bit>
 #include <iostream>
 
 void Chunk::write(const uint8_t byte, const int line) {
     code.push_back(byte);
-    lines.push_back(line);
+
+    if (lines.empty() || lines.back().line != line)
+        lines.push_back({static_cast<int>(code.size()) - 1, line});
+}
+
+static const char* op_names[] = {
+    "OP_CONSTANT", "OP_ADD", "OP_SUBTRACT", "OP_MULTIPLY", "OP_DIVIDE", "OP_NEGATE", "OP_RETURN",
+    "OP_ADD_CONSTANT", "OP_SUBTRACT_CONSTANT", "OP_MULTIPLY_CONSTANT", "OP_DIVIDE_CONSTANT",
+    "OP_CONSTANT_LONG", "OP_INPUT",
+};
+
+static const char* register_op_names[] = {
+    "LOADK", "LOADK_LONG",
+    "ADD_RR", "ADD_RK", "ADD_KR",
+    "SUBTRACT_RR", "SUBTRACT_RK", "SUBTRACT_KR",
+    "MULTIPLY_RR", "MULTIPLY_RK", "MULTIPLY_KR",
+    "DIVIDE_RR", "DIVIDE_RK", "DIVIDE_KR",
+    "NEGATE", "RETURN", "LOADI",
+};
+
+static_assert(std::size(op_names) == static_cast<size_t>(OpCode::INPUT) + 1);
+static_assert(std::size(register_op_names) == static_cast<size_t>(RegOpCode::LOADI) + 1);
+
+const char* opcode_name(const ChunkFormat format, const uint8_t opcode) {
+    if (format == ChunkFormat::REGISTER)
+        return opcode < std::size(register_op_names) ? register_op_names[opcode] : "UNKNOWN";
+    return opcode < std::size(op_names) ? op_names[opcode] : "UNKNOWN";
 }
 
+int find_line(const LineStart* lines, const size_t count, const int offset) {
+    // first run starting past offset, the one before it holds offset
+    const LineStart* run = std::upper_bound(lines, lines + count, offset,
+        [](const int value, const LineStart &start) { return value < start.offset; });
+    if (run == lines) return -1;
+    return (run - 1)->line;
+}
+
+int Chunk::get_line(const int offset) const {
+    return find_line(lines.data(), lines.size(), offset);
+}
+
+ChunkView Chunk::view() const {
+    return {
+        code.data(), code.size(),
+        constants.data(), constants.count(),
+        lines.data(), lines.size(),
+        maxStackDepth, format, inputCount,
+    };
+}
+
+void Chunk::clear() {
+    code.clear();
+    lines.clear();
+    constants.truncate(0);
+    std::ranges::fill(constantSlots, 0);
+    maxStackDepth = 0;
+    format = ChunkFormat::STACK;
+    inputCount = 0;
+}
+
+static size_t hash_bits(uint64_t bits) {
+    bits ^= bits >> 33;
+    bits *= 0xff51afd7ed558ccdull;
+    bits ^= bits >> 33;
+    return static_cast<size_t>(bits);
+}
+
+// The slot holding bits, or the empty slot where it would go. The table is
+// kept at most half full, so probing always ends.
+size_t Chunk::find_constant_slot(const uint64_t bits) const {
+    const size_t mask = constantSlots.size() - 1;
+    size_t slot = hash_bits(bits) & mask;
+    while (constantSlots[slot] != 0
+           && constants.get_value_at(static_cast<int>(constantSlots[slot] - 1)).raw_bits() != bits)
+        slot = (slot + 1) & mask;
+    return slot;
+}
+
+void Chunk::grow_constant_slots() {
+    constantSlots.assign(std::max<size_t>(16, constantSlots.size() * 2), 0);
+    for (size_t i = 0; i < constants.count(); ++i)
+        constantSlots[find_constant_slot(constants.get_value_at(static_cast<int>(i)).raw_bits())] = static_cast<uint32_t>(i + 1);
+}
+
+// Backward-shift deletion: later entries of the probe run move into the gap
+// unless that would put them before their home slot.
+void Chunk::erase_constant_slot(const uint64_t bits) {
+    const size_t mask = constantSlots.size() - 1;
+    size_t gap = find_constant_slot(bits);
+    constantSlots[gap] = 0;
+
+    for (size_t next = (gap + 1) & mask; constantSlots[next] != 0; next = (next + 1) & mask) {
+        const uint64_t nextBits = constants.get_value_at(static_cast<int>(constantSlots[next] - 1)).raw_bits();
+        const size_t home = hash_bits(nextBits) & mask;
+        if (((next - home) & mask) >= ((next - gap) & mask)) {
+            constantSlots[gap] = constantSlots[next];
+            constantSlots[next] = 0;
+            gap = next;
+        }
+    }
+}
+
+// Identical values share one slot. Keys are the raw bits, so 0 and -0 stay
+// distinct and a NaN matches only itself.
 size_t Chunk::add_constant(const Value value) {
-    constants.write(value);
-    return constants.count() - 1;
+    if ((constants.count() + 1) * 2 > constantSlots.size())
+        grow_constant_slots();
+
+    const size_t slot = find_constant_slot(value.raw_bits());
+    if (constantSlots[slot] == 0) {
+        constantSlots[slot] = static_cast<uint32_t>(constants.count() + 1);
+        constants.write(value);
+    }
+    return constantSlots[slot] - 1;
+}
+
+void Chunk::truncate_code(const int count) {
+    code.resize(count);
+    while (!lines.empty() && lines.back().offset >= count)
+        lines.pop_back();
+}
+
+void Chunk::truncate_constants(const size_t count) {
+    for (size_t i = constants.count(); i > count; --i)
+        erase_constant_slot(constants.get_value_at(static_cast<int>(i - 1)).raw_bits());
+    constants.truncate(count);
+}
+
+int Chunk::count() const {
+    return static_cast<int>(code.size());
+}
+
+size_t Chunk::constant_count() const {
+    return constants.count();
+}
+
+void Chunk::set_max_stack_depth(const int depth) {
+    maxStackDepth = depth;
+}
+
+int Chunk::get_max_stack_depth() const {
+    return maxStackDepth;
+}
+
+void Chunk::set_format(const ChunkFormat chunkFormat) {
+    format = chunkFormat;
+}
+
+ChunkFormat Chunk::get_format() const {
+    return format;
+}
+
+void Chunk::set_input_count(const int count) {
+    inputCount = count;
+}
+
+int Chunk::get_input_count() const {
+    return inputCount;
 }
 
 uint8_t Chunk::get_code_at(const int offset) const {
@@ -24,6 +178,12 @@ Value Chunk::get_constant_at(const int offset) const {
     return constants.get_value_at(offset);
 }
 
+size_t Chunk::get_constant_index(const int offset) const {
+    if (code[offset] == static_cast<uint8_t>(OpCode::CONSTANT_LONG))
+        return code[offset + 1] | (code[offset + 2] << 8) | (code[offset + 3] << 16);
+    return code[offset + 1];
+}
+
 void Chunk::print_value(const int offset) const {
     constants.print_value(offset);
 }
@@ -31,55 +191,145 @@ void Chunk::print_value(const int offset) const {
 
 
 
-#ifdef DEBUG
-void Chunk::disassemble(const std::string &name) const {
-    std::cout << "== " << name.c_str() << " ==" << std::endl;
+static size_t constant_index(const ChunkView &chunk, const int offset) {
+    const uint8_t* code = chunk.code + offset;
+    if (code[0] == static_cast<uint8_t>(OpCode::CONSTANT_LONG))
+        return code[1] | (code[2] << 8) | (code[3] << 16);
+    return code[1];
+}
 
-    for (int offset = 0; offset < code.size();) {
-        offset = this->disassemble_instruction(offset);
-    }
+static void print_constant(const ChunkView &chunk, const size_t index, FILE* out) {
+    if (index < chunk.constantCount)
+        print_value(chunk.constants[index], out);
+    else
+        std::fprintf(out, "<out of range>");
 }
 
-static int constant_instruction(const std::string &name, const Chunk* chunk, const int offset) {
-    const uint8_t constant = chunk->get_code_at(offset + 1);
-    std::printf("%-16s %4d '", name.c_str(), constant);
-    chunk->print_value(constant);
-    std::printf("'\n");
-    return offset + 2; // OP_CONSTANT is two bytes
+static int constant_instruction(const char* name, const ChunkView &chunk, const int offset, FILE* out) {
+    const size_t constant = constant_index(chunk, offset);
+    std::fprintf(out, "%-20s %4zu '", name, constant);
+    print_constant(chunk, constant, out);
+    std::fprintf(out, "'\n");
+    return offset + instruction_size(static_cast<OpCode>(chunk.code[offset]));
 }
 
-static int simple_instruction(const std::string &name, const int offset) {
-    std::printf("%s\n", name.c_str());
-    return offset + 1; // OP_RETURN is two bytes
+static int input_instruction(const char* name, const ChunkView &chunk, const int offset, FILE* out) {
+    std::fprintf(out, "%-20s    $%d\n", name, chunk.code[offset + 1]);
+    return offset + 2;
 }
 
-int Chunk::disassemble_instruction(const int offset) const {
-    std::printf("%04d ", offset);
+static int simple_instruction(const char* name, const int offset, FILE* out) {
+    std::fprintf(out, "%s\n", name);
+    return offset + 1;
+}
+
+static void register_operand(const ChunkView &chunk, const bool isConstant, const size_t operand, FILE* out) {
+    if (!isConstant) {
+        std::fprintf(out, " r%zu", operand);
+        return;
+    }
+    std::fprintf(out, " k%zu '", operand);
+    print_constant(chunk, operand, out);
+    std::fprintf(out, "'");
+}
 
-    if (offset > 0 && lines[offset] == lines[offset - 1])
-        printf("   | ");
+static int register_instruction(const ChunkView &chunk, const int offset, FILE* out) {
+    const uint8_t* code = chunk.code + offset;
+    const auto op = static_cast<RegOpCode>(code[0]);
+    if (op > RegOpCode::LOADI) {
+        std::fprintf(out, "Unknown opcode %d\n", code[0]);
+        return offset + 1;
+    }
+
+    std::fprintf(out, "R_%-18s", register_op_names[static_cast<int>(op)]);
+    switch (op) {
+        case RegOpCode::LOADK:
+            register_operand(chunk, false, code[1], out);
+            register_operand(chunk, true, code[2], out);
+            break;
+        case RegOpCode::LOADK_LONG:
+            register_operand(chunk, false, code[1], out);
+            register_operand(chunk, true, code[2] | (code[3] << 8) | (code[4] << 16), out);
+            break;
+        case RegOpCode::NEGATE:
+            register_operand(chunk, false, code[1], out);
+            register_operand(chunk, false, code[2], out);
+            break;
+        case RegOpCode::RETURN:
+            register_operand(chunk, false, code[1], out);
+            break;
+        case RegOpCode::LOADI:
+            register_operand(chunk, false, code[1], out);
+            std::fprintf(out, " $%d", code[2]);
+            break;
+        default: {
+            // forms repeat RR, RK, KR from ADD_RR on
+            const int form = (static_cast<int>(op) - static_cast<int>(RegOpCode::ADD_RR)) % 3;
+            register_operand(chunk, false, code[1], out);
+            register_operand(chunk, form == 2, code[2], out);
+            register_operand(chunk, form == 1, code[3], out);
+            break;
+        }
+    }
+    std::fprintf(out, "\n");
+    return offset + register_instruction_size(op);
+}
+
+int disassemble_instruction(const ChunkView &chunk, const int offset, FILE* out) {
+    std::fprintf(out, "%04d ", offset);
+
+    const int line = find_line(chunk.lines, chunk.lineCount, offset);
+    if (offset > 0 && line == find_line(chunk.lines, chunk.lineCount, offset - 1))
+        std::fprintf(out, "   | ");
     else
-        printf("%4d ", lines[offset]);
+        std::fprintf(out, "%4d ", line);
+
+    if (chunk.format == ChunkFormat::REGISTER)
+        return register_instruction(chunk, offset, out);
 
-    switch (const uint8_t instruction = code[offset]) {
+    switch (const uint8_t instruction = chunk.code[offset]) {
         case static_cast<int>(OpCode::CONSTANT):
-            return constant_instruction("OP_CONSTANT", this, offset);
+            return constant_instruction("OP_CONSTANT", chunk, offset, out);
         case static_cast<int>(OpCode::ADD):
-            return simple_instruction("OP_ADD", offset);
+            return simple_instruction("OP_ADD", offset, out);
         case static_cast<int>(OpCode::SUBTRACT):
-            return simple_instruction("OP_SUBTRACT", offset);
+            return simple_instruction("OP_SUBTRACT", offset, out);
         case static_cast<int>(OpCode::MULTIPLY):
-            return simple_instruction("OP_MULTIPLY", offset);
+            return simple_instruction("OP_MULTIPLY", offset, out);
         case static_cast<int>(OpCode::DIVIDE):
-            return simple_instruction("OP_DIVIDE", offset);
+            return simple_instruction("OP_DIVIDE", offset, out);
         case static_cast<int>(OpCode::NEGATE):
-            return simple_instruction("OP_NEGATE", offset);
+            return simple_instruction("OP_NEGATE", offset, out);
         case static_cast<int>(OpCode::RETURN):
-            return simple_instruction("OP_RETURN", offset);
+            return simple_instruction("OP_RETURN", offset, out);
+        case static_cast<int>(OpCode::ADD_CONSTANT):
+            return constant_instruction("OP_ADD_CONSTANT", chunk, offset, out);
+        case static_cast<int>(OpCode::SUBTRACT_CONSTANT):
+            return constant_instruction("OP_SUBTRACT_CONSTANT", chunk, offset, out);
+        case static_cast<int>(OpCode::MULTIPLY_CONSTANT):
+            return constant_instruction("OP_MULTIPLY_CONSTANT", chunk, offset, out);
+        case static_cast<int>(OpCode::DIVIDE_CONSTANT):
+            return constant_instruction("OP_DIVIDE_CONSTANT", chunk, offset, out);
+        case static_cast<int>(OpCode::CONSTANT_LONG):
+            return constant_instruction("OP_CONSTANT_LONG", chunk, offset, out);
+        case static_cast<int>(OpCode::INPUT):
+            return input_instruction("OP_INPUT", chunk, offset, out);
         default:
-            std::printf("Unknown opcode %d\n", instruction);
+            std::fprintf(out, "Unknown opcode %d\n", instruction);
             return offset + 1;
     }
 }
-#endif
 
+#ifdef DEBUG
+void Chunk::disassemble(const std::string &name) const {
+    std::cout << "== " << name.c_str() << " ==" << std::endl;
+
+    for (int offset = 0; offset < code.size();) {
+        offset = this->disassemble_instruction(offset);
+    }
+}
+
+int Chunk::disassemble_instruction(const int offset) const {
+    return ::disassemble_instruction(view(), offset);
+}
+#endif
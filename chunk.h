@@ -14,27 +14,161 @@ enum class OpCode : uint8_t {
     DIVIDE,
     NEGATE,
     RETURN,
+
+    // superinstructions: CONSTANT k followed by the binary op, fused by the
+    // peephole stage; top = top op k
+    ADD_CONSTANT,
+    SUBTRACT_CONSTANT,
+    MULTIPLY_CONSTANT,
+    DIVIDE_CONSTANT,
+
+    CONSTANT_LONG, // 24-bit little-endian constant index
+    INPUT,         // input index: pushes $index
 };
 
+constexpr size_t MAX_SHORT_CONSTANT = UINT8_MAX;
+constexpr size_t MAX_LONG_CONSTANT = 0xFFFFFF;
+constexpr size_t MAX_INPUT_INDEX = UINT8_MAX;
+
+// Net number of values an instruction leaves on the stack.
+constexpr int stack_effect(const OpCode op) {
+    switch (op) {
+        case OpCode::CONSTANT:
+        case OpCode::CONSTANT_LONG:
+        case OpCode::INPUT: return 1;
+        case OpCode::ADD:
+        case OpCode::SUBTRACT:
+        case OpCode::MULTIPLY:
+        case OpCode::DIVIDE: return -1;
+        case OpCode::NEGATE: return 0;
+        case OpCode::RETURN: return -1;
+        case OpCode::ADD_CONSTANT:
+        case OpCode::SUBTRACT_CONSTANT:
+        case OpCode::MULTIPLY_CONSTANT:
+        case OpCode::DIVIDE_CONSTANT: return 0;
+    }
+    return 0;
+}
+
+// Opcode plus operand bytes.
+constexpr int instruction_size(const OpCode op) {
+    switch (op) {
+        case OpCode::CONSTANT:
+        case OpCode::ADD_CONSTANT:
+        case OpCode::SUBTRACT_CONSTANT:
+        case OpCode::MULTIPLY_CONSTANT:
+        case OpCode::DIVIDE_CONSTANT:
+        case OpCode::INPUT: return 2;
+        case OpCode::CONSTANT_LONG: return 4;
+        default: return 1;
+    }
+}
+
+// Three-address instruction set for the register VM. Operands are one byte
+// each: registers r0..r255, or a constant index in the slot an _RK/_KR form
+// marks as constant.
+enum class RegOpCode : uint8_t {
+    LOADK,      // dst k
+    LOADK_LONG, // dst k24
+    ADD_RR, ADD_RK, ADD_KR, // dst a b
+    SUBTRACT_RR, SUBTRACT_RK, SUBTRACT_KR,
+    MULTIPLY_RR, MULTIPLY_RK, MULTIPLY_KR,
+    DIVIDE_RR, DIVIDE_RK, DIVIDE_KR,
+    NEGATE,     // dst src
+    RETURN,     // src
+    LOADI,      // dst input
+};
+
+constexpr int register_instruction_size(const RegOpCode op) {
+    switch (op) {
+        case RegOpCode::LOADK:
+        case RegOpCode::LOADI:
+        case RegOpCode::NEGATE: return 3;
+        case RegOpCode::LOADK_LONG: return 5;
+        case RegOpCode::RETURN: return 2;
+        default: return 4;
+    }
+}
+
+enum class ChunkFormat : uint8_t {
+    STACK,    // OpCode, run by VM::run
+    REGISTER, // RegOpCode, run by VM::run_registers
+};
+
+// One entry per run of bytes emitted for the same source line; a run ends
+// where the next one starts.
+struct LineStart {
+    int offset;
+    int line;
+};
+
+[[nodiscard]] const char* opcode_name(ChunkFormat format, uint8_t opcode);
+[[nodiscard]] int find_line(const LineStart* lines, size_t count, int offset);
+
+// Everything the VM reads while executing, without owning any of it. Made
+// from a Chunk, or directly over a mapped bytecode file.
+struct ChunkView {
+    const uint8_t* code;
+    size_t codeSize;
+    const Value* constants;
+    size_t constantCount;
+    const LineStart* lines;
+    size_t lineCount;
+    int maxStackDepth;
+    ChunkFormat format;
+    int inputCount; // highest $n read, plus one
+};
+
+// Prints the instruction at offset and returns the offset of the next one.
+int disassemble_instruction(const ChunkView &chunk, int offset, FILE* out = stdout);
+
 class Chunk {
     std::vector<uint8_t> code;
-    std::vector<int> lines;
+    std::vector<LineStart> lines;
     ValueArray constants;
+    // open-addressed index from value bits to pool slot, so add_constant can
+    // dedup without per-entry nodes; 0 is empty, otherwise pool index + 1
+    std::vector<uint32_t> constantSlots;
+    int maxStackDepth = 0; // register count for ChunkFormat::REGISTER
+    ChunkFormat format = ChunkFormat::STACK;
+    int inputCount = 0;
+
+    [[nodiscard]] size_t find_constant_slot(uint64_t bits) const;
+    void grow_constant_slots();
+    void erase_constant_slot(uint64_t bits);
 
 public:
     Chunk() = default;
+    Chunk(Chunk &&) = default;
+    Chunk &operator=(Chunk &&) = default;
     ~Chunk() {
         code.clear();
         lines.clear();
     };
 
+    // Empties the chunk but keeps its buffers, so a recycled chunk refills
+    // without allocating.
+    void clear();
     void write(uint8_t byte, int line);
     size_t add_constant(Value value);
+    void truncate_code(int count);
+    void truncate_constants(size_t count);
+    void set_max_stack_depth(int depth);
+    [[nodiscard]] int get_max_stack_depth() const;
+    void set_format(ChunkFormat chunkFormat);
+    [[nodiscard]] ChunkFormat get_format() const;
+    void set_input_count(int count);
+    [[nodiscard]] int get_input_count() const;
+    [[nodiscard]] int get_line(int offset) const;
+    [[nodiscard]] int count() const;
+    [[nodiscard]] size_t constant_count() const;
 
     void print_value(int offset) const;
     [[nodiscard]] uint8_t get_code_at(int offset) const;
     [[nodiscard]] uint8_t* get_code();
     [[nodiscard]] Value get_constant_at(int offset) const;
+    [[nodiscard]] size_t get_constant_index(int offset) const;
+    [[nodiscard]] ChunkView view() const;
 
 #ifdef DEBUG
     void disassemble(const std::string &name) const;
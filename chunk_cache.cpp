@@ -0,0 +1,63 @@
+﻿#include "chunk_cache.h"
+
+uint64_t ChunkCache::key(const std::string_view source, const uint8_t options) {
+    return std::hash<std::string_view>{}(source) ^ options * 0x9E3779B97F4A7C15ull;
+}
+
+void ChunkCache::evict_to(const size_t count) {
+    while (mEntries.size() > count) {
+        mIndex.erase(mEntries.back().key);
+        mEntries.pop_back();
+    }
+}
+
+CompiledScript ChunkCache::find(const std::string_view source, const uint8_t options) {
+    if (mCapacity == 0) return nullptr;
+
+    const auto found = mIndex.find(key(source, options));
+    if (found == mIndex.end() || found->second->options != options || found->second->source != source) {
+        ++mMisses;
+        return nullptr;
+    }
+
+    ++mHits;
+    mEntries.splice(mEntries.begin(), mEntries, found->second);
+    return found->second->script;
+}
+
+void ChunkCache::insert(const std::string_view source, const uint8_t options, CompiledScript script) {
+    if (mCapacity == 0) return;
+
+    // a colliding entry for other source is replaced, not chained
+    const uint64_t hash = key(source, options);
+    if (const auto found = mIndex.find(hash); found != mIndex.end()) {
+        mEntries.erase(found->second);
+        mIndex.erase(found);
+    }
+
+    evict_to(mCapacity - 1);
+    mEntries.push_front({hash, options, std::string(source), std::move(script)});
+    mIndex.emplace(hash, mEntries.begin());
+}
+
+bool ChunkCache::missed_before(const std::string_view source, const uint8_t options) {
+    const uint64_t hash = key(source, options);
+    for (const uint64_t recent : mRecentMisses) {
+        if (recent == hash) return true;
+    }
+
+    mRecentMisses[mNextMiss] = hash;
+    mNextMiss = (mNextMiss + 1) % mRecentMisses.size();
+    return false;
+}
+
+void ChunkCache::set_capacity(const size_t capacity) {
+    mCapacity = capacity;
+    evict_to(capacity);
+}
+
+void ChunkCache::clear() {
+    mEntries.clear();
+    mIndex.clear();
+    mRecentMisses.fill(0);
+}
@@ -0,0 +1,58 @@
+﻿#pragma once
+
+#include <array>
+#include <list>
+#include <memory>
+#include <unordered_map>
+
+#include "chunk.h"
+#include "common.h"
+
+// An immutable compiled chunk. Shared, so a script handle stays valid after
+// the cache that produced it has evicted or replaced the entry.
+using CompiledScript = std::shared_ptr<const Chunk>;
+
+// Least-recently-used cache of compiled chunks keyed by a hash of the source
+// and the compile options that shaped the bytecode. Each entry keeps its
+// source text, so a hash collision counts as a miss rather than returning
+// another script's chunk. A capacity of 0 disables the cache. Not
+// thread-safe.
+class ChunkCache {
+    struct Entry {
+        uint64_t key;
+        uint8_t options;
+        std::string source;
+        CompiledScript script;
+    };
+
+    std::list<Entry> mEntries; // most recently used first
+    std::unordered_map<uint64_t, std::list<Entry>::iterator> mIndex;
+    size_t mCapacity;
+    uint64_t mHits = 0;
+    uint64_t mMisses = 0;
+    // keys of the last few misses, a fixed ring so noting one never allocates
+    std::array<uint64_t, 64> mRecentMisses{};
+    size_t mNextMiss = 0;
+
+    [[nodiscard]] static uint64_t key(std::string_view source, uint8_t options);
+    void evict_to(size_t count);
+
+public:
+    explicit ChunkCache(size_t capacity = 0) : mCapacity(capacity) {}
+
+    // The chunk compiled from source under options, or null. Counts a hit or a
+    // miss unless the cache is disabled.
+    [[nodiscard]] CompiledScript find(std::string_view source, uint8_t options);
+    void insert(std::string_view source, uint8_t options, CompiledScript script);
+    // Whether source missed recently under options; otherwise remembers this
+    // miss. Lets callers give entries only to sources that come back. A hash
+    // collision just caches a source early.
+    [[nodiscard]] bool missed_before(std::string_view source, uint8_t options);
+    void set_capacity(size_t capacity);
+    void clear();
+
+    [[nodiscard]] size_t size() const { return mEntries.size(); }
+    [[nodiscard]] size_t capacity() const { return mCapacity; }
+    [[nodiscard]] uint64_t hits() const { return mHits; }
+    [[nodiscard]] uint64_t misses() const { return mMisses; }
+};
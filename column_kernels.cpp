@@ -0,0 +1,107 @@
+﻿#include "column_kernels.h"
+
+#include <cstdlib>
+#include <string_view>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAS_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+// Every kernel is a vector loop over whole blocks of WIDTH doubles plus a
+// scalar loop for the rest, so none reads or writes past count.
+#define DEFINE_COLUMN_KERNELS(PREFIX, TARGET, VEC, WIDTH, LOAD, STORE, SET1, XOR, ADD, SUB, MUL, DIV) \
+    DEFINE_BINARY(PREFIX, TARGET, VEC, WIDTH, LOAD, STORE, SET1, add, ADD, +) \
+    DEFINE_BINARY(PREFIX, TARGET, VEC, WIDTH, LOAD, STORE, SET1, subtract, SUB, -) \
+    DEFINE_BINARY(PREFIX, TARGET, VEC, WIDTH, LOAD, STORE, SET1, multiply, MUL, *) \
+    DEFINE_BINARY(PREFIX, TARGET, VEC, WIDTH, LOAD, STORE, SET1, divide, DIV, /) \
+    TARGET static void PREFIX##_negate(double* out, const double* a, const size_t count) { \
+        const VEC sign = SET1(-0.0); \
+        size_t i = 0; \
+        for (; i + WIDTH <= count; i += WIDTH) STORE(out + i, XOR(LOAD(a + i), sign)); \
+        for (; i < count; ++i) out[i] = -a[i]; \
+    } \
+    TARGET static void PREFIX##_fill(double* out, const double k, const size_t count) { \
+        const VEC broadcast = SET1(k); \
+        size_t i = 0; \
+        for (; i + WIDTH <= count; i += WIDTH) STORE(out + i, broadcast); \
+        for (; i < count; ++i) out[i] = k; \
+    } \
+    static constexpr ColumnKernels PREFIX##Kernels = { \
+        #PREFIX, \
+        {PREFIX##_add, PREFIX##_subtract, PREFIX##_multiply, PREFIX##_divide}, \
+        {PREFIX##_add_constant, PREFIX##_subtract_constant, PREFIX##_multiply_constant, PREFIX##_divide_constant}, \
+        PREFIX##_negate, PREFIX##_fill, \
+    };
+
+#define DEFINE_BINARY(PREFIX, TARGET, VEC, WIDTH, LOAD, STORE, SET1, NAME, INTRINSIC, OP) \
+    TARGET static void PREFIX##_##NAME(double* out, const double* a, const double* b, const size_t count) { \
+        size_t i = 0; \
+        for (; i + WIDTH <= count; i += WIDTH) STORE(out + i, INTRINSIC(LOAD(a + i), LOAD(b + i))); \
+        for (; i < count; ++i) out[i] = a[i] OP b[i]; \
+    } \
+    TARGET static void PREFIX##_##NAME##_constant(double* out, const double* a, const double k, const size_t count) { \
+        const VEC broadcast = SET1(k); \
+        size_t i = 0; \
+        for (; i + WIDTH <= count; i += WIDTH) STORE(out + i, INTRINSIC(LOAD(a + i), broadcast)); \
+        for (; i < count; ++i) out[i] = a[i] OP k; \
+    }
+
+// The scalar "vector" is one double, so the block loop does all the work.
+#define SCALAR_LOAD(p) (*(p))
+#define SCALAR_STORE(p, v) (*(p) = (v))
+#define SCALAR_SET1(k) (k)
+#define SCALAR_XOR(a, b) ((void) (b), -(a))
+#define SCALAR_ADD(a, b) ((a) + (b))
+#define SCALAR_SUB(a, b) ((a) - (b))
+#define SCALAR_MUL(a, b) ((a) * (b))
+#define SCALAR_DIV(a, b) ((a) / (b))
+
+DEFINE_COLUMN_KERNELS(scalar, , double, 1,
+                      SCALAR_LOAD, SCALAR_STORE, SCALAR_SET1, SCALAR_XOR,
+                      SCALAR_ADD, SCALAR_SUB, SCALAR_MUL, SCALAR_DIV)
+
+#ifdef HAS_X86_KERNELS
+
+DEFINE_COLUMN_KERNELS(sse2, __attribute__((target("sse2"))), __m128d, 2,
+                      _mm_loadu_pd, _mm_storeu_pd, _mm_set1_pd, _mm_xor_pd,
+                      _mm_add_pd, _mm_sub_pd, _mm_mul_pd, _mm_div_pd)
+
+DEFINE_COLUMN_KERNELS(avx2, __attribute__((target("avx2"))), __m256d, 4,
+                      _mm256_loadu_pd, _mm256_storeu_pd, _mm256_set1_pd, _mm256_xor_pd,
+                      _mm256_add_pd, _mm256_sub_pd, _mm256_mul_pd, _mm256_div_pd)
+
+#endif
+
+#undef SCALAR_DIV
+#undef SCALAR_MUL
+#undef SCALAR_SUB
+#undef SCALAR_ADD
+#undef SCALAR_XOR
+#undef SCALAR_SET1
+#undef SCALAR_STORE
+#undef SCALAR_LOAD
+#undef DEFINE_BINARY
+#undef DEFINE_COLUMN_KERNELS
+
+static const ColumnKernels &select_kernels() {
+    const char* forced = std::getenv("HEX_COLUMN_KERNEL");
+    const std::string_view choice = forced ? forced : "";
+    if (choice == "scalar") return scalarKernels;
+
+#ifdef HAS_X86_KERNELS
+    __builtin_cpu_init();
+    const bool avx2 = __builtin_cpu_supports("avx2");
+    const bool sse2 = __builtin_cpu_supports("sse2");
+    if (choice == "sse2" && sse2) return sse2Kernels;
+    if (avx2 && choice != "sse2") return avx2Kernels;
+    if (sse2) return sse2Kernels;
+#endif
+
+    return scalarKernels;
+}
+
+const ColumnKernels &column_kernels() {
+    static const ColumnKernels &kernels = select_kernels();
+    return kernels;
+}
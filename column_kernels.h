@@ -0,0 +1,24 @@
+﻿#pragma once
+
+#include "common.h"
+
+// Element-wise loops over columns of count doubles, used by
+// VM::execute_batch to run one instruction over a whole tile of rows. They
+// do the same IEEE operations as the scalar VM, so every non-NaN result is
+// bit-identical; a NaN may come out with another sign or payload (see
+// same_result). out may alias a.
+struct ColumnKernels {
+    const char* name;
+    // out[i] = a[i] op b[i], indexed ADD, SUBTRACT, MULTIPLY, DIVIDE
+    void (*binary[4])(double* out, const double* a, const double* b, size_t count);
+    // out[i] = a[i] op k, same order
+    void (*binary_constant[4])(double* out, const double* a, double k, size_t count);
+    // out[i] = -a[i]
+    void (*negate)(double* out, const double* a, size_t count);
+    // out[i] = k
+    void (*fill)(double* out, double k, size_t count);
+};
+
+// The widest implementation this CPU runs (AVX2, SSE2 or scalar), picked on
+// first use. HEX_COLUMN_KERNEL=scalar|sse2|avx2 forces one, for comparisons.
+[[nodiscard]] const ColumnKernels &column_kernels();
@@ -3,4 +3,5 @@
 #include <cstdbool>
 #include <cstddef>
 #include <cstdint>
-#include <string>
\ No newline at end of file
+#include <string>
+#include <string_view>
\ No newline at end of file
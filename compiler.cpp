@@ -1,38 +1,40 @@
 ﻿#include "compiler.h"
 
-void error_at(const Token *token, const std::string &message) {
-    if (parser.mPanicMode) return;
-    parser.mPanicMode = true;
+#include <charconv>
 
-    std::fprintf(stderr, "[line %d] Error", token->line);
+void Parser::error_at(const Token *token, const std::string_view message) {
+    if (mPanicMode) return;
+    mPanicMode = true;
+
+    std::fprintf(mpErrorStream, "[line %d] Error", token->line);
 
     if (token->type == TokenType::END_OF_FILE) {
-        std::fprintf(stderr, " at end");
+        std::fprintf(mpErrorStream, " at end");
     }
     else if (token->type == TokenType::ERROR) {
         ///
     }
     else {
-        std::fprintf(stderr, " at '%.*s'", static_cast<int>(token->lexeme.length()), token->lexeme.c_str());
+        std::fprintf(mpErrorStream, " at '%.*s'", static_cast<int>(token->lexeme.length()), token->lexeme.data());
     }
 
-    std::fprintf(stderr, ": %s\n", message.c_str());
-    parser.mHadError = true;
+    std::fprintf(mpErrorStream, ": %.*s\n", static_cast<int>(message.length()), message.data());
+    mHadError = true;
 }
 
-void error_at_current(const std::string &message) {
-    error_at(parser.get_current(), message);
+void Parser::error_at_current(const std::string_view message) {
+    error_at(&mCurrent, message);
 }
 
-void error(const std::string &message) {
-    error_at(parser.get_previous(), message);
+void Parser::error(const std::string_view message) {
+    error_at(&mPrevious, message);
 }
 
 void Parser::advance() {
     mPrevious = mCurrent;
 
     for (;;) {
-        mCurrent = mpScanner->scan_token();
+        mCurrent = mTokens ? mTokens->at(mTokenIndex++) : mScanner->scan_token();
         if (mCurrent.type != TokenType::ERROR) break;
 
         error_at_current(mCurrent.lexeme);
@@ -43,7 +45,7 @@ void Parser::expression() {
     parse_precedence(Precedence::ASSIGNMENT);
 }
 
-void Parser::consume(const TokenType type, const std::string &message) {
+void Parser::consume(const TokenType type, const std::string_view message) {
     if (mCurrent.type == type) {
         advance();
         return;
@@ -61,16 +63,43 @@ void Parser::emit_bytes(const uint8_t byte1, const uint8_t byte2) const {
     emit_byte(byte2);
 }
 
-void emit_return() {
-    parser.emit_byte(static_cast<uint8_t>(OpCode::RETURN));
+void Parser::emit_op(const OpCode op) {
+    mOpStarts.push_back({mCompilingChunk->count(), mCompilingChunk->constant_count()});
+    emit_byte(static_cast<uint8_t>(op));
+
+    mStackDepth += stack_effect(op);
+    if (mStackDepth > mMaxStackDepth)
+        mMaxStackDepth = mStackDepth;
 }
 
-void emit_constant(Value value) {
-    parser.emit_bytes(static_cast<uint8_t>(OpCode::CONSTANT), parser.make_constant(value));
+void Parser::emit_return() {
+    emit_op(OpCode::RETURN);
 }
 
-void Parser::end_compiler() const {
-    emit_return();
+void Parser::emit_constant(const Value value) {
+    const size_t constant = make_constant(value);
+
+    if (constant <= MAX_SHORT_CONSTANT) {
+        emit_op(OpCode::CONSTANT);
+        emit_byte(static_cast<uint8_t>(constant));
+        return;
+    }
+
+    emit_op(OpCode::CONSTANT_LONG);
+    emit_byte(static_cast<uint8_t>(constant & 0xFF));
+    emit_byte(static_cast<uint8_t>((constant >> 8) & 0xFF));
+    emit_byte(static_cast<uint8_t>((constant >> 16) & 0xFF));
+}
+
+void Parser::end_compiler() {
+    if (mRegisterMode) {
+        register_return();
+        mCompilingChunk->set_format(ChunkFormat::REGISTER);
+    }
+    else
+        emit_return();
+    mCompilingChunk->set_max_stack_depth(mMaxStackDepth);
+    mCompilingChunk->set_input_count(mInputCount);
 #ifdef DEBUG
     if (!mHadError) {
         mCompilingChunk->disassemble("code");
@@ -78,46 +107,255 @@ void Parser::end_compiler() const {
 #endif
 }
 
+// Same double operations the VM performs, so folded results are bit-identical.
+static Value fold(const OpCode op, const Value a, const Value b) {
+    switch (op) {
+        case OpCode::ADD: return Value::number(a.as_number() + b.as_number());
+        case OpCode::SUBTRACT: return Value::number(a.as_number() - b.as_number());
+        case OpCode::MULTIPLY: return Value::number(a.as_number() * b.as_number());
+        case OpCode::DIVIDE: return Value::number(a.as_number() / b.as_number());
+        case OpCode::NEGATE: return Value::number(-a.as_number());
+        default: return Value::nix(); // unreachable
+    }
+}
+
+// Replaces the operand CONSTANTs of op with a single CONSTANT holding the
+// result. The last operand must be exactly the instruction at operandStart;
+// a left operand ending in CONSTANT is always a lone literal, since any
+// other expression finishes with the instruction that produces its value.
+bool Parser::fold_constants(const OpCode op, const int operands, const int operandStart) {
+    if (!mFoldConstants) return false;
+    if (mOpStarts.size() < static_cast<size_t>(operands) || mOpStarts.back().offset != operandStart)
+        return false;
+    if (op != OpCode::ADD && op != OpCode::SUBTRACT && op != OpCode::MULTIPLY
+        && op != OpCode::DIVIDE && op != OpCode::NEGATE)
+        return false;
+
+    const size_t first = mOpStarts.size() - operands;
+    std::array<Value, 2> values{};
+    for (int i = 0; i < operands; ++i) {
+        const int start = mOpStarts[first + i].offset;
+        const uint8_t instruction = mCompilingChunk->get_code_at(start);
+        if (instruction != static_cast<uint8_t>(OpCode::CONSTANT)
+            && instruction != static_cast<uint8_t>(OpCode::CONSTANT_LONG))
+            return false;
+        values[i] = mCompilingChunk->get_constant_at(static_cast<int>(mCompilingChunk->get_constant_index(start)));
+    }
+
+    const Value result = fold(op, values[0], values[1]);
+
+    // constants added since the first operand began belong to the operands alone
+    mCompilingChunk->truncate_constants(mOpStarts[first].constants);
+    mCompilingChunk->truncate_code(mOpStarts[first].offset);
+    mOpStarts.resize(first);
+    mStackDepth -= operands;
+
+    emit_constant(result);
+    return true;
+}
+
+// Registers are handed out stack-wise, so every register at or above an
+// operand's register is a temporary of that operand.
+int Parser::allocate_register() {
+    if (mFreeRegister > UINT8_MAX) {
+        error("Too many registers in one chunk.");
+        return 0;
+    }
+
+    const int reg = mFreeRegister++;
+    if (mFreeRegister > mMaxStackDepth)
+        mMaxStackDepth = mFreeRegister;
+    return reg;
+}
+
+int Parser::load_operand(const Operand &operand) {
+    if (!operand.isConstant) return operand.reg;
+
+    const int reg = allocate_register();
+    const size_t constant = make_constant(operand.value);
+    if (constant <= MAX_SHORT_CONSTANT) {
+        emit_byte(static_cast<uint8_t>(RegOpCode::LOADK));
+        emit_byte(static_cast<uint8_t>(reg));
+        emit_byte(static_cast<uint8_t>(constant));
+    }
+    else {
+        emit_byte(static_cast<uint8_t>(RegOpCode::LOADK_LONG));
+        emit_byte(static_cast<uint8_t>(reg));
+        emit_byte(static_cast<uint8_t>(constant & 0xFF));
+        emit_byte(static_cast<uint8_t>((constant >> 8) & 0xFF));
+        emit_byte(static_cast<uint8_t>((constant >> 16) & 0xFF));
+    }
+    return reg;
+}
+
+// Whether operand can sit directly in a one-byte constant slot.
+bool Parser::short_constant(const Operand &operand, int *index) {
+    if (!operand.isConstant) return false;
+
+    const size_t constant = make_constant(operand.value);
+    if (constant > MAX_SHORT_CONSTANT) return false;
+
+    *index = static_cast<int>(constant);
+    return true;
+}
+
+void Parser::register_binary(const OpCode op) {
+    if (mOperands.size() < 2) return; // only after a compile error
+
+    const Operand right = mOperands.back();
+    mOperands.pop_back();
+    const Operand left = mOperands.back();
+    mOperands.pop_back();
+
+    if (mFoldConstants && left.isConstant && right.isConstant) {
+        mOperands.push_back({true, fold(op, left.value, right.value), 0});
+        return;
+    }
+
+    // at most one side may be a constant slot; a literal left operand is
+    // loaded after the right one, so take the lower register as destination
+    int b;
+    const bool constantB = short_constant(right, &b);
+    int a;
+    const bool constantA = !constantB && short_constant(left, &a);
+    if (!constantA) a = load_operand(left);
+    if (!constantB) b = load_operand(right);
+
+    int dst;
+    if (constantA) dst = b;
+    else if (constantB) dst = a;
+    else dst = std::min(a, b);
+    mFreeRegister = dst + 1;
+
+    int base;
+    switch (op) {
+        case OpCode::ADD: base = static_cast<int>(RegOpCode::ADD_RR); break;
+        case OpCode::SUBTRACT: base = static_cast<int>(RegOpCode::SUBTRACT_RR); break;
+        case OpCode::MULTIPLY: base = static_cast<int>(RegOpCode::MULTIPLY_RR); break;
+        case OpCode::DIVIDE: base = static_cast<int>(RegOpCode::DIVIDE_RR); break;
+        default: return; // unreachable
+    }
+    const int form = constantA ? 2 : constantB ? 1 : 0;
+
+    emit_byte(static_cast<uint8_t>(base + form));
+    emit_byte(static_cast<uint8_t>(dst));
+    emit_byte(static_cast<uint8_t>(a));
+    emit_byte(static_cast<uint8_t>(b));
+    mOperands.push_back({false, Value::nix(), dst});
+}
+
+void Parser::register_negate() {
+    if (mOperands.empty()) return; // only after a compile error
+
+    const Operand operand = mOperands.back();
+    mOperands.pop_back();
+
+    if (mFoldConstants && operand.isConstant) {
+        mOperands.push_back({true, fold(OpCode::NEGATE, operand.value, operand.value), 0});
+        return;
+    }
+
+    const int reg = load_operand(operand);
+    mFreeRegister = reg + 1;
+    emit_byte(static_cast<uint8_t>(RegOpCode::NEGATE));
+    emit_byte(static_cast<uint8_t>(reg));
+    emit_byte(static_cast<uint8_t>(reg));
+    mOperands.push_back({false, Value::nix(), reg});
+}
+
+void Parser::register_return() {
+    if (mOperands.empty()) return; // only after a compile error
+
+    const int reg = load_operand(mOperands.back());
+    mOperands.pop_back();
+    emit_byte(static_cast<uint8_t>(RegOpCode::RETURN));
+    emit_byte(static_cast<uint8_t>(reg));
+}
+
 const ParseRule *get_rule(const TokenType type) {
     return &rules[static_cast<size_t>(type)];
 }
 
 void Parser::number() {
-    const Value value = std::stod(parser.get_previous()->lexeme);
-    emit_constant(value);
+    const std::string_view lexeme = mPrevious.lexeme;
+    double number = 0;
+    std::from_chars(lexeme.data(), lexeme.data() + lexeme.size(), number);
+    const Value value = Value::number(number);
+
+    if (mRegisterMode)
+        mOperands.push_back({true, value, 0});
+    else
+        emit_constant(value);
+}
+
+void Parser::input() {
+    const std::string_view lexeme = mPrevious.lexeme.substr(1);
+    size_t index = 0;
+    const std::errc status = std::from_chars(lexeme.data(), lexeme.data() + lexeme.size(), index).ec;
+    if (status != std::errc() || index > MAX_INPUT_INDEX) {
+        error("Input index out of range.");
+        return;
+    }
+    if (static_cast<int>(index) >= mInputCount)
+        mInputCount = static_cast<int>(index) + 1;
+
+    if (mRegisterMode) {
+        const int reg = allocate_register();
+        emit_byte(static_cast<uint8_t>(RegOpCode::LOADI));
+        emit_byte(static_cast<uint8_t>(reg));
+        emit_byte(static_cast<uint8_t>(index));
+        mOperands.push_back({false, Value::nix(), reg});
+        return;
+    }
+
+    emit_op(OpCode::INPUT);
+    emit_byte(static_cast<uint8_t>(index));
 }
 
 void Parser::grouping() {
-    parser.expression();
-    parser.consume(TokenType::RIGHT_PAREN, "Expect ')' after expression");
+    expression();
+    consume(TokenType::RIGHT_PAREN, "Expect ')' after expression");
 }
 
 void Parser::unary() {
-    const TokenType operatorType = parser.get_previous()->type;
+    const TokenType operatorType = mPrevious.type;
+    const int operandStart = mCompilingChunk->count();
 
-    parser.parse_precedence(Precedence::UNARY);
+    parse_precedence(Precedence::UNARY);
 
     switch (operatorType) {
-        case TokenType::MINUS: parser.emit_byte(static_cast<uint8_t>(OpCode::NEGATE)); break;
+        case TokenType::MINUS:
+            if (mRegisterMode)
+                register_negate();
+            else if (!fold_constants(OpCode::NEGATE, 1, operandStart))
+                emit_op(OpCode::NEGATE);
+            break;
         default:
             return; // unreachable
     }
 }
 
 void Parser::binary() {
-    const TokenType operatorType = parser.get_previous()->type;
+    const TokenType operatorType = mPrevious.type;
 
     const ParseRule *rule = get_rule(operatorType);
-    parser.parse_precedence(static_cast<Precedence>(static_cast<int>(rule->precedence) + 1));
+    const int operandStart = mCompilingChunk->count();
+    parse_precedence(static_cast<Precedence>(static_cast<int>(rule->precedence) + 1));
 
+    OpCode op;
     switch (operatorType) {
-        case TokenType::PLUS: parser.emit_byte(static_cast<uint8_t>(OpCode::ADD)); break;
-        case TokenType::MINUS: parser.emit_byte(static_cast<uint8_t>(OpCode::SUBTRACT)); break;
-        case TokenType::STAR: parser.emit_byte(static_cast<uint8_t>(OpCode::MULTIPLY)); break;
-        case TokenType::SLASH: parser.emit_byte(static_cast<uint8_t>(OpCode::DIVIDE)); break;
+        case TokenType::PLUS: op = OpCode::ADD; break;
+        case TokenType::MINUS: op = OpCode::SUBTRACT; break;
+        case TokenType::STAR: op = OpCode::MULTIPLY; break;
+        case TokenType::SLASH: op = OpCode::DIVIDE; break;
         default:
             return; //unreachable
     }
+
+    if (mRegisterMode)
+        register_binary(op);
+    else if (!fold_constants(op, 2, operandStart))
+        emit_op(op);
 }
 
 
@@ -129,33 +367,69 @@ void Parser::parse_precedence(Precedence precedence) {
         return;
     }
 
-    prefix_rule();
+    (this->*prefix_rule)();
 
     while (precedence <= get_rule(get_current()->type)->precedence) {
         advance();
         const ParseFn infix_rule = get_rule(get_previous()->type)->infix;
-        infix_rule();
+        (this->*infix_rule)();
     }
 }
 
 
 
-uint8_t Parser::make_constant(const Value value) const {
+size_t Parser::make_constant(const Value value) {
     const size_t constant = mCompilingChunk->add_constant(value);
-    if (constant > SIZE_MAX) {
+    if (constant > MAX_LONG_CONSTANT) {
         error("Too many constants in one chunk.");
         return 0;
     }
-    return static_cast<uint8_t>(constant);
+    return constant;
 }
 
 
-bool Parser::compile(std::string &source, Chunk* chunk) {
-    mpScanner = std::make_unique<Scanner>(source);
+// Drops everything the previous compilation kept in the arena, then rewinds
+// it. The vectors' old storage is simply abandoned.
+void Parser::reset_arena() {
+    mScanner.reset();
+    mTokens.reset();
+    mOpStarts = std::pmr::vector<OpStart>(&mArena);
+    mOperands = std::pmr::vector<Operand>(&mArena);
+    mArena.reset();
+}
+
+bool Parser::compile(const std::string_view source, Chunk* chunk) {
+    reset_arena();
+    if (!mBulkScan || !TokenBuffer::fits(source)) {
+        mScanner.emplace(source);
+        return compile_tokens(chunk);
+    }
+
+    mTokens.emplace(source, &mArena);
+    mTokenIndex = 0;
+    const bool compiled = compile_tokens(chunk);
+    // lexemes point into the source, so the tokens held here stay valid;
+    // this also stops a background scan the parser gave up on
+    mTokens.reset();
+    return compiled;
+}
+
+bool Parser::compile(std::istream &stream, Chunk* chunk) {
+    reset_arena();
+    mScanner.emplace(stream);
+    return compile_tokens(chunk);
+}
+
+// Compiles from whichever of mScanner and mTokens is set.
+bool Parser::compile_tokens(Chunk* chunk) {
     mCompilingChunk = chunk;
 
     mHadError = false;
     mPanicMode = false;
+    mStackDepth = 0;
+    mMaxStackDepth = 0;
+    mFreeRegister = 0;
+    mInputCount = 0;
 
     advance();
     expression();
@@ -1,11 +1,15 @@
 ﻿#pragma once
 
 #include <array>
-#include <memory>
+#include <memory_resource>
+#include <optional>
 #include <string>
+#include <vector>
 
+#include "arena.h"
+#include "chunk.h"
 #include "scanner.h"
-#include "vm.h"
+#include "token_buffer.h"
 
 enum class Precedence {
     NONE,           //
@@ -21,7 +25,8 @@ enum class Precedence {
     PRIMARY,
 };
 
-typedef void (*ParseFn)();
+class Parser;
+typedef void (Parser::*ParseFn)();
 
 struct ParseRule {
     ParseFn prefix;
@@ -31,78 +36,125 @@ struct ParseRule {
 
 
 
+// Where an emitted instruction begins, and the constant pool size just
+// before it, so folding can rewind both.
+struct OpStart {
+    int offset;
+    size_t constants;
+};
+
+// A finished subexpression in register mode: either a literal not yet
+// placed anywhere, or the register holding the value.
+struct Operand {
+    bool isConstant;
+    Value value;
+    int reg;
+};
+
 class Parser {
     Token mCurrent;
     Token mPrevious;
     Chunk *mCompilingChunk;
-    std::unique_ptr<Scanner> mpScanner;
+    Arena mArena; // compile-time allocations; rewound when a compilation starts
+    std::optional<Scanner> mScanner;
+    std::optional<TokenBuffer> mTokens; // replaces mScanner in bulk scan mode
+    size_t mTokenIndex = 0;
+    int mStackDepth = 0;
+    int mMaxStackDepth = 0;
+    std::pmr::vector<OpStart> mOpStarts{&mArena}; // every instruction emitted so far
+    std::pmr::vector<Operand> mOperands{&mArena}; // register mode only
+    int mFreeRegister = 0;
+    int mInputCount = 0;
+
+    void reset_arena();
+    [[nodiscard]] bool compile_tokens(Chunk *chunk);
 
 public:
     bool mHadError = false;
     bool mPanicMode = false;
+    bool mFoldConstants = true;
+    bool mRegisterMode = false;
+    bool mBulkScan = false; // tokenize in-memory sources up front into a TokenBuffer
+    FILE* mpErrorStream = stderr; // compile errors
 
     Parser() = default;
     ~Parser() = default;
 
+    void error_at(const Token *token, std::string_view message);
+    void error_at_current(std::string_view message);
+    void error(std::string_view message);
     void advance();
     void expression();
-    void consume(TokenType type, const std::string &message);
+    void consume(TokenType type, std::string_view message);
     void emit_byte(uint8_t byte) const;
     void emit_bytes(uint8_t byte1, uint8_t byte2) const;
-    void end_compiler() const;
-    static void number();
-    static void grouping();
-    static void unary();
-    static void binary();
+    void emit_op(OpCode op);
+    void emit_return();
+    void emit_constant(Value value);
+    [[nodiscard]] bool fold_constants(OpCode op, int operands, int operandStart);
+    [[nodiscard]] int allocate_register();
+    [[nodiscard]] int load_operand(const Operand &operand);
+    [[nodiscard]] bool short_constant(const Operand &operand, int *index);
+    void register_binary(OpCode op);
+    void register_negate();
+    void register_return();
+    void end_compiler();
+    void number();
+    void input();
+    void grouping();
+    void unary();
+    void binary();
     void parse_precedence(Precedence precedence);
-    [[nodiscard]] uint8_t make_constant(Value value) const;
-    [[nodiscard]] bool compile(std::string &source, Chunk *chunk);
+    [[nodiscard]] size_t make_constant(Value value);
+    [[nodiscard]] bool compile(std::string_view source, Chunk *chunk);
+    [[nodiscard]] bool compile(std::istream &stream, Chunk *chunk);
 
     [[nodiscard]] Token* get_current() {return &mCurrent;}
     [[nodiscard]] Token* get_previous() {return &mPrevious;}
+    // scratch memory of the current compilation, valid until the next one
+    [[nodiscard]] std::pmr::memory_resource* arena() {return &mArena;}
 };
 
-inline Parser parser;
-
 inline constexpr std::array rules = {
-    ParseRule{Parser::grouping, nullptr,        Precedence::NONE}, //LEFT_PAREN
-    ParseRule{nullptr,          nullptr,        Precedence::NONE}, //RIGHT_PAREN
-    ParseRule{nullptr,          nullptr,        Precedence::NONE}, //LEFT_BRACE
-    ParseRule{nullptr,          nullptr,        Precedence::NONE}, //RIGHT_BRACE
-    ParseRule{nullptr,          nullptr,        Precedence::NONE}, //COMMA
-    ParseRule{nullptr,          nullptr,        Precedence::NONE}, //DOT
-    ParseRule{Parser::unary,    Parser::binary, Precedence::TERM}, //MINUS
-    ParseRule{nullptr,          Parser::binary, Precedence::TERM}, //PLUS
-    ParseRule{nullptr,          nullptr,        Precedence::NONE}, //SEMICOLON
-    ParseRule{nullptr,          Parser::binary, Precedence::FACTOR}, //SLASH
-    ParseRule{nullptr,          Parser::binary, Precedence::FACTOR}, //STAR
-    ParseRule{nullptr,          nullptr,        Precedence::NONE}, //BANG
-    ParseRule{nullptr,          nullptr,        Precedence::NONE}, //BANG_EQUAL
-    ParseRule{nullptr,          nullptr,        Precedence::NONE}, //EQUAL
-    ParseRule{nullptr,          nullptr,        Precedence::NONE}, //EQUAL_EQUAL
-    ParseRule{nullptr,          nullptr,        Precedence::NONE}, //GREATER
-    ParseRule{nullptr,          nullptr,        Precedence::NONE}, //GREATER_EQUAL
-    ParseRule{nullptr,          nullptr,        Precedence::NONE}, //LESS
-    ParseRule{nullptr,          nullptr,        Precedence::NONE}, //LESS_EQUAL
-    ParseRule{nullptr,          nullptr,        Precedence::NONE}, //IDENTIFIER
-    ParseRule{nullptr,          nullptr,        Precedence::NONE}, //STRING
-    ParseRule{Parser::number,   nullptr,        Precedence::NONE}, //NUMBER
-    ParseRule{nullptr,          nullptr,        Precedence::NONE}, //AND
-    ParseRule{nullptr,          nullptr,        Precedence::NONE}, //CLASS
-    ParseRule{nullptr,          nullptr,        Precedence::NONE}, //ELSE
-    ParseRule{nullptr,          nullptr,        Precedence::NONE}, //FALSE
-    ParseRule{nullptr,          nullptr,        Precedence::NONE}, //FOR
-    ParseRule{nullptr,          nullptr,        Precedence::NONE}, //FUN
-    ParseRule{nullptr,          nullptr,        Precedence::NONE}, //IF
-    ParseRule{nullptr,          nullptr,        Precedence::NONE}, //NIL
-    ParseRule{nullptr,          nullptr,        Precedence::NONE}, //OR
-    ParseRule{nullptr,          nullptr,        Precedence::NONE}, //PRINT
-    ParseRule{nullptr,          nullptr,        Precedence::NONE}, //RETURN
-    ParseRule{nullptr,          nullptr,        Precedence::NONE}, //SUPER
-    ParseRule{nullptr,          nullptr,        Precedence::NONE}, //THIS
-    ParseRule{nullptr,          nullptr,        Precedence::NONE}, //TRUE
-    ParseRule{nullptr,          nullptr,        Precedence::NONE}, //VAR
-    ParseRule{nullptr,          nullptr,        Precedence::NONE}, //WHILE
-    ParseRule{nullptr,          nullptr,        Precedence::NONE}, //ERROR
-    ParseRule{nullptr,          nullptr,        Precedence::NONE}, //EOF
+    ParseRule{&Parser::grouping, nullptr,         Precedence::NONE}, //LEFT_PAREN
+    ParseRule{nullptr,           nullptr,         Precedence::NONE}, //RIGHT_PAREN
+    ParseRule{nullptr,           nullptr,         Precedence::NONE}, //LEFT_BRACE
+    ParseRule{nullptr,           nullptr,         Precedence::NONE}, //RIGHT_BRACE
+    ParseRule{nullptr,           nullptr,         Precedence::NONE}, //COMMA
+    ParseRule{nullptr,           nullptr,         Precedence::NONE}, //DOT
+    ParseRule{&Parser::unary,    &Parser::binary, Precedence::TERM}, //MINUS
+    ParseRule{nullptr,           &Parser::binary, Precedence::TERM}, //PLUS
+    ParseRule{nullptr,           nullptr,         Precedence::NONE}, //SEMICOLON
+    ParseRule{nullptr,           &Parser::binary, Precedence::FACTOR}, //SLASH
+    ParseRule{nullptr,           &Parser::binary, Precedence::FACTOR}, //STAR
+    ParseRule{nullptr,           nullptr,         Precedence::NONE}, //BANG
+    ParseRule{nullptr,           nullptr,         Precedence::NONE}, //BANG_EQUAL
+    ParseRule{nullptr,           nullptr,         Precedence::NONE}, //EQUAL
+    ParseRule{nullptr,           nullptr,         Precedence::NONE}, //EQUAL_EQUAL
+    ParseRule{nullptr,           nullptr,         Precedence::NONE}, //GREATER
+    ParseRule{nullptr,           nullptr,         Precedence::NONE}, //GREATER_EQUAL
+    ParseRule{nullptr,           nullptr,         Precedence::NONE}, //LESS
+    ParseRule{nullptr,           nullptr,         Precedence::NONE}, //LESS_EQUAL
+    ParseRule{nullptr,           nullptr,         Precedence::NONE}, //IDENTIFIER
+    ParseRule{nullptr,           nullptr,         Precedence::NONE}, //STRING
+    ParseRule{&Parser::number,   nullptr,         Precedence::NONE}, //NUMBER
+    ParseRule{&Parser::input,    nullptr,         Precedence::NONE}, //INPUT
+    ParseRule{nullptr,           nullptr,         Precedence::NONE}, //AND
+    ParseRule{nullptr,           nullptr,         Precedence::NONE}, //CLASS
+    ParseRule{nullptr,           nullptr,         Precedence::NONE}, //ELSE
+    ParseRule{nullptr,           nullptr,         Precedence::NONE}, //FALSE
+    ParseRule{nullptr,           nullptr,         Precedence::NONE}, //FOR
+    ParseRule{nullptr,           nullptr,         Precedence::NONE}, //FUN
+    ParseRule{nullptr,           nullptr,         Precedence::NONE}, //IF
+    ParseRule{nullptr,           nullptr,         Precedence::NONE}, //NIL
+    ParseRule{nullptr,           nullptr,         Precedence::NONE}, //OR
+    ParseRule{nullptr,           nullptr,         Precedence::NONE}, //PRINT
+    ParseRule{nullptr,           nullptr,         Precedence::NONE}, //RETURN
+    ParseRule{nullptr,           nullptr,         Precedence::NONE}, //SUPER
+    ParseRule{nullptr,           nullptr,         Precedence::NONE}, //THIS
+    ParseRule{nullptr,           nullptr,         Precedence::NONE}, //TRUE
+    ParseRule{nullptr,           nullptr,         Precedence::NONE}, //VAR
+    ParseRule{nullptr,           nullptr,         Precedence::NONE}, //WHILE
+    ParseRule{nullptr,           nullptr,         Precedence::NONE}, //ERROR
+    ParseRule{nullptr,           nullptr,         Precedence::NONE}, //EOF
 };
\ No newline at end of file
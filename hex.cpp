@@ -0,0 +1,73 @@
+﻿#include "hex.h"
+
+struct HexInterpreter {
+    VM vm;
+    CompiledScript script; // set by hex_compile
+};
+
+struct HexScript {
+    CompiledScript chunk;
+};
+
+static InterpretResult run_chunk(HexInterpreter* interpreter, const Chunk &chunk, Value* result) {
+    const InterpretResult status = interpreter->vm.execute(chunk.view());
+    if (status == InterpretResult::INTERPRET_OK && result != nullptr)
+        *result = interpreter->vm.mResult;
+    return status;
+}
+
+HexInterpreter* hex_create(const HexOptions &options) {
+    auto* interpreter = new HexInterpreter();
+    interpreter->vm.mParser.mFoldConstants = options.foldConstants;
+    interpreter->vm.mParser.mRegisterMode = options.registers;
+    interpreter->vm.mParser.mBulkScan = options.bulkScan;
+    interpreter->vm.mPeephole = options.peephole;
+    interpreter->vm.mJit = options.jit;
+    interpreter->vm.mChecks = options.checks;
+    interpreter->vm.mPrintResult = options.printResult;
+    interpreter->vm.mChunkCache.set_capacity(options.chunkCacheSize);
+    return interpreter;
+}
+
+void hex_destroy(HexInterpreter* interpreter) {
+    delete interpreter;
+}
+
+HexScript* hex_prepare(HexInterpreter* interpreter, const std::string_view source) {
+    CompiledScript chunk = interpreter->vm.prepare(source);
+    if (!chunk) return nullptr;
+    return new HexScript{std::move(chunk)};
+}
+
+void hex_release(HexScript* script) {
+    delete script;
+}
+
+InterpretResult hex_execute(HexInterpreter* interpreter, const HexScript* script, Value* result) {
+    return run_chunk(interpreter, *script->chunk, result);
+}
+
+InterpretResult hex_execute_batch(HexInterpreter* interpreter, const HexScript* script,
+                                  const double* const* columns, const size_t columnCount, const size_t rows,
+                                  double* results) {
+    return interpreter->vm.execute_batch(script->chunk->view(), {columns, columnCount}, rows, results);
+}
+
+void hex_set_inputs(HexInterpreter* interpreter, const Value* inputs, const size_t count) {
+    interpreter->vm.mInputs = {inputs, count};
+}
+
+bool hex_compile(HexInterpreter* interpreter, const std::string_view source) {
+    interpreter->script = interpreter->vm.prepare(source);
+    return interpreter->script != nullptr;
+}
+
+InterpretResult hex_run(HexInterpreter* interpreter, Value* result) {
+    if (!interpreter->script) return InterpretResult::INTERPRET_COMPILE_ERROR;
+    return run_chunk(interpreter, *interpreter->script, result);
+}
+
+HexCacheStats hex_cache_stats(const HexInterpreter* interpreter) {
+    const ChunkCache &cache = interpreter->vm.mChunkCache;
+    return {cache.hits(), cache.misses(), cache.size(), cache.capacity()};
+}
@@ -0,0 +1,69 @@
+﻿#pragma once
+
+#include "common.h"
+#include "value.h"
+#include "vm.h"
+
+// Embedding API. Every interpreter owns its parser, VM and compiled chunk,
+// so separate interpreters can be driven from separate threads at once. One
+// interpreter must only be used by one thread at a time.
+struct HexOptions {
+    bool foldConstants = true;
+    bool peephole = false;
+    bool registers = false;
+    bool bulkScan = false;
+    bool jit = false; // run stack chunks as native code in JIT builds
+    bool checks = false; // validate every instruction before it runs, e.g. for untrusted .hexb files
+    bool printResult = false; // also print each result to stdout, as the CLI does
+    size_t chunkCacheSize = 64; // compiled scripts kept per interpreter, 0 to disable
+};
+
+struct HexInterpreter;
+struct HexScript;
+
+struct HexCacheStats {
+    uint64_t hits;
+    uint64_t misses;
+    size_t entries;
+    size_t capacity;
+};
+
+[[nodiscard]] HexInterpreter* hex_create(const HexOptions &options = {});
+void hex_destroy(HexInterpreter* interpreter);
+
+// Compiles source into a script that can be executed any number of times.
+// Source seen before under the same options comes from the interpreter's
+// chunk cache without being scanned or compiled again. Returns null on a
+// compile error, which is reported on stderr. A script holds its own
+// reference to the chunk, so it stays valid after eviction and may be run on
+// any interpreter.
+[[nodiscard]] HexScript* hex_prepare(HexInterpreter* interpreter, std::string_view source);
+void hex_release(HexScript* script);
+
+// Runs script on interpreter, storing its value in *result when given.
+InterpretResult hex_execute(HexInterpreter* interpreter, const HexScript* script, Value* result = nullptr);
+
+// Runs script once per row: columns[k] holds $k for all rows, and row i's
+// value goes to results[i]. Stack scripts execute each instruction over a
+// tile of rows with SIMD kernels rather than dispatching once per row; other
+// scripts, and instrumented interpreters, run row by row. Both paths give
+// the same bits for every non-NaN result, but a NaN result may differ in
+// sign and payload between them. On an error, results from the failing row
+// on are left as they were.
+InterpretResult hex_execute_batch(HexInterpreter* interpreter, const HexScript* script,
+                                  const double* const* columns, size_t columnCount, size_t rows, double* results);
+
+// Binds $0, $1, ... for later hex_execute and hex_run calls. The array is
+// not copied and must stay valid until it is replaced. Box outside doubles
+// with Value::checked_number, so a NaN payload cannot read as another type.
+void hex_set_inputs(HexInterpreter* interpreter, const Value* inputs, size_t count);
+
+// Compiles source, replacing the previously compiled script. Errors are
+// reported on stderr.
+[[nodiscard]] bool hex_compile(HexInterpreter* interpreter, std::string_view source);
+
+// Runs the compiled script, storing its value in *result when given. Returns
+// INTERPRET_COMPILE_ERROR if nothing has compiled successfully.
+InterpretResult hex_run(HexInterpreter* interpreter, Value* result = nullptr);
+
+[[nodiscard]] HexCacheStats hex_cache_stats(const HexInterpreter* interpreter);
@@ -0,0 +1,176 @@
+﻿#include "jit.h"
+
+#include <cstring>
+
+#ifdef JIT
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace {
+
+// SSE2 opcodes, all behind the 0x0F escape.
+constexpr uint8_t MOVSD = 0x10; // F2
+constexpr uint8_t ADDSD = 0x58; // F2
+constexpr uint8_t MULSD = 0x59; // F2
+constexpr uint8_t SUBSD = 0x5C; // F2
+constexpr uint8_t DIVSD = 0x5E; // F2
+constexpr uint8_t MOVAPD = 0x28; // 66
+constexpr uint8_t XORPD = 0x57; // 66
+
+constexpr int SIGN_MASK = 15;
+
+void emit_rex(std::vector<uint8_t> &code, const int reg, const int rm) {
+    if (reg >= 8 || rm >= 8)
+        code.push_back(0x40 | (reg >= 8 ? 4 : 0) | (rm >= 8 ? 1 : 0));
+}
+
+// op xmm<dst>, xmm<src>
+void emit_rr(std::vector<uint8_t> &code, const uint8_t prefix, const uint8_t op, const int dst, const int src) {
+    code.push_back(prefix);
+    emit_rex(code, dst, src);
+    code.insert(code.end(), {0x0F, op, static_cast<uint8_t>(0xC0 | (dst & 7) << 3 | (src & 7))});
+}
+
+constexpr int RSI = 6; // inputs
+constexpr int RDI = 7; // constant pool
+
+// op xmm<dst>, [base + 8 * index]
+void emit_rm(std::vector<uint8_t> &code, const uint8_t op, const int dst, const int base, const size_t index) {
+    const size_t displacement = index * sizeof(Value);
+    code.push_back(0xF2);
+    emit_rex(code, dst, 0);
+    code.push_back(0x0F);
+    code.push_back(op);
+    if (displacement < 0x80) {
+        code.push_back(static_cast<uint8_t>(0x40 | (dst & 7) << 3 | base));
+        code.push_back(static_cast<uint8_t>(displacement));
+    } else {
+        code.push_back(static_cast<uint8_t>(0x80 | (dst & 7) << 3 | base));
+        for (int shift = 0; shift < 32; shift += 8)
+            code.push_back(static_cast<uint8_t>(displacement >> shift));
+    }
+}
+
+uint8_t arithmetic(const OpCode op) {
+    switch (op) {
+        case OpCode::ADD:
+        case OpCode::ADD_CONSTANT: return ADDSD;
+        case OpCode::SUBTRACT:
+        case OpCode::SUBTRACT_CONSTANT: return SUBSD;
+        case OpCode::MULTIPLY:
+        case OpCode::MULTIPLY_CONSTANT: return MULSD;
+        default: return DIVSD;
+    }
+}
+
+size_t page_round(const size_t bytes) {
+    const auto page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    return (bytes + page - 1) / page * page;
+}
+
+}
+
+Jit::~Jit() {
+    if (mpBuffer != nullptr) munmap(mpBuffer, mCapacity);
+}
+
+bool Jit::translate(const ChunkView &chunk) {
+    if (chunk.format != ChunkFormat::STACK || chunk.maxStackDepth > MAX_STACK_DEPTH)
+        return false;
+
+    mCode.clear();
+    // movabs rax, SIGN_BIT; movq xmm15, rax
+    mCode.insert(mCode.end(), {0x48, 0xB8, 0, 0, 0, 0, 0, 0, 0, 0x80});
+    mCode.insert(mCode.end(), {0x66, 0x4C, 0x0F, 0x6E, 0xF8});
+
+    int depth = 0;
+    for (size_t offset = 0; offset < chunk.codeSize;) {
+        const auto op = static_cast<OpCode>(chunk.code[offset]);
+        const uint8_t* operands = chunk.code + offset + 1;
+        switch (op) {
+            case OpCode::CONSTANT:
+                emit_rm(mCode, MOVSD, depth++, RDI, operands[0]);
+                break;
+            case OpCode::CONSTANT_LONG:
+                emit_rm(mCode, MOVSD, depth++, RDI, operands[0] | operands[1] << 8 | operands[2] << 16);
+                break;
+            case OpCode::INPUT:
+                emit_rm(mCode, MOVSD, depth++, RSI, operands[0]);
+                break;
+            case OpCode::ADD:
+            case OpCode::SUBTRACT:
+            case OpCode::MULTIPLY:
+            case OpCode::DIVIDE:
+                --depth;
+                emit_rr(mCode, 0xF2, arithmetic(op), depth - 1, depth);
+                break;
+            case OpCode::ADD_CONSTANT:
+            case OpCode::SUBTRACT_CONSTANT:
+            case OpCode::MULTIPLY_CONSTANT:
+            case OpCode::DIVIDE_CONSTANT:
+                emit_rm(mCode, arithmetic(op), depth - 1, RDI, operands[0]);
+                break;
+            case OpCode::NEGATE:
+                emit_rr(mCode, 0x66, XORPD, depth - 1, SIGN_MASK);
+                break;
+            case OpCode::RETURN:
+                if (depth != 1) emit_rr(mCode, 0x66, MOVAPD, 0, depth - 1);
+                mCode.push_back(0xC3); // ret
+                return true;
+            default:
+                return false;
+        }
+        offset += instruction_size(op);
+    }
+    return false; // no RETURN
+}
+
+bool Jit::install() {
+    if (mCode.size() > mCapacity) {
+        if (mpBuffer != nullptr) munmap(mpBuffer, mCapacity);
+        mCapacity = page_round(mCode.size());
+        void* buffer = mmap(nullptr, mCapacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        mpBuffer = buffer == MAP_FAILED ? nullptr : static_cast<uint8_t*>(buffer);
+    } else if (mprotect(mpBuffer, mCapacity, PROT_READ | PROT_WRITE) != 0) {
+        return false;
+    }
+
+    if (mpBuffer == nullptr) {
+        mCapacity = 0;
+        return false;
+    }
+
+    std::memcpy(mpBuffer, mCode.data(), mCode.size());
+    return mprotect(mpBuffer, mCapacity, PROT_READ | PROT_EXEC) == 0;
+}
+
+bool Jit::compile(const ChunkView &chunk) {
+    if (!mBytecode.empty() && chunk.format == ChunkFormat::STACK && mBytecode.size() == chunk.codeSize &&
+        std::memcmp(mBytecode.data(), chunk.code, chunk.codeSize) == 0)
+        return true;
+
+    mBytecode.clear();
+    if (!translate(chunk) || !install())
+        return false;
+    mBytecode.assign(chunk.code, chunk.code + chunk.codeSize);
+    return true;
+}
+
+Value Jit::run(const Value* constants, const Value* inputs) const {
+    using Function = double (*)(const Value*, const Value*);
+    return Value::number(reinterpret_cast<Function>(mpBuffer)(constants, inputs));
+}
+
+#else
+
+Jit::~Jit() = default;
+
+bool Jit::compile(const ChunkView &) {
+    return false;
+}
+
+Value Jit::run(const Value*, const Value*) const {
+    return Value::nix();
+}
+
+#endif
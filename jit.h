@@ -0,0 +1,38 @@
+﻿#pragma once
+
+#include <vector>
+
+#include "chunk.h"
+#include "common.h"
+
+// Baseline template JIT for stack chunks on x86-64 Linux. Every instruction
+// becomes a fixed SSE2 sequence; stack slot n lives in xmmN for the whole
+// function, so nothing touches memory but the constant pool and the inputs.
+// Code goes into an mmap'd buffer that is writable or executable, never both.
+// Chunks it cannot handle (register format, deeper than MAX_STACK_DEPTH, or
+// any build without JIT) are refused and run by the interpreter instead.
+class Jit {
+    static constexpr int MAX_STACK_DEPTH = 15; // xmm0-xmm14; xmm15 holds the sign mask
+
+    std::vector<uint8_t> mCode; // staged machine code
+    std::vector<uint8_t> mBytecode; // what the code in mpBuffer was translated from; empty if none
+    uint8_t* mpBuffer = nullptr;
+    size_t mCapacity = 0;
+
+    [[nodiscard]] bool translate(const ChunkView &chunk);
+    [[nodiscard]] bool install();
+
+public:
+    Jit() = default;
+    Jit(const Jit &) = delete;
+    Jit &operator=(const Jit &) = delete;
+    ~Jit();
+
+    // Translates chunk into native code. The code depends only on the
+    // bytecode, not the constant values, so running the same script again
+    // reuses it after one comparison.
+    [[nodiscard]] bool compile(const ChunkView &chunk);
+    // Runs the code from the last successful compile() against constants
+    // and inputs.
+    [[nodiscard]] Value run(const Value* constants, const Value* inputs) const;
+};
@@ -1,13 +1,30 @@
-﻿#include <iostream>
+﻿#include <chrono>
+#include <iostream>
 #include <fstream>
-#include <sstream>
+#include <memory>
+#include <thread>
+#include <vector>
 
 #include "common.h"
+#include "bytecode_file.h"
 #include "chunk.h"
+#include "source_file.h"
 #include "vm.h"
+#include "work_pool.h"
 
-static void repl() {
+static bool useCache = false;
+static const char* samplePath = nullptr; // --sample: collapsed stacks go here
+
+// SIGPROF rate for --sample, in samples per CPU second.
+static constexpr int DEFAULT_SAMPLE_FREQUENCY = 1000;
+
+// Lines the REPL keeps compiled, so re-entering one skips the front end.
+static constexpr size_t REPL_CHUNK_CACHE_SIZE = 64;
+
+static void repl(VM &vm) {
     char line[1024];
+    vm.mChunkCache.set_capacity(REPL_CHUNK_CACHE_SIZE);
+    vm.mSampler.mScript = "repl";
     for (;;) {
         std::printf("> ");
 
@@ -15,41 +32,331 @@ static void repl() {
             std::printf("\n");
             break;
         }
-        std::string strLine(line); 
-        vm.interpret(strLine);
+        vm.interpret(std::string_view(line));
+    }
+}
+
+// Runs path from its "<path>.hexb" bytecode cache when that is still fresh,
+// otherwise compiles it and rewrites the cache. Returns false if path could
+// not be stamped.
+static bool interpret_cached(VM &vm, const char* path, const SourceFile &source, InterpretResult* result) {
+    SourceStamp stamp{};
+    if (!stamp_source(path, vm.compile_options(), &stamp))
+        return false;
+
+    const std::string cachePath = std::string(path) + ".hexb";
+    MappedChunk mapped;
+    if (mapped.open(cachePath.c_str(), stamp)) {
+        *result = vm.execute(mapped.view());
+        return true;
+    }
+
+    Chunk chunk;
+    if (!vm.compile(source.text(), &chunk)) {
+        *result = InterpretResult::INTERPRET_COMPILE_ERROR;
+        return true;
+    }
+
+    if (!write_bytecode_file(cachePath.c_str(), chunk, stamp))
+        std::fprintf(vm.mpErrorStream, "Could not write bytecode cache \"%s\".\n", cachePath.c_str());
+
+    *result = vm.execute(chunk.view());
+    return true;
+}
+
+static int could_not_open(const VM &vm, const char* path) {
+    std::fprintf(vm.mpErrorStream, "Could not open file \"%s\".\n", path);
+    return 74;
+}
+
+// Runs one script and returns the exit status it would give the process.
+// Regular files are mapped and scanned in place. Pipes, devices and "-" for
+// stdin are streamed through the scanner in blocks instead of being read
+// whole, and never use the bytecode cache.
+static int run_file(VM &vm, const char* path) {
+    InterpretResult result;
+    SourceFile source;
+    if (vm.mSample) vm.mSampler.mScript = std::string_view(path) == "-" ? "stdin" : path;
+
+    if (std::string_view(path) == "-")
+        result = vm.interpret(std::cin);
+    else switch (source.open(path)) {
+        case SourceFile::OpenResult::MAPPED:
+            if (!useCache)
+                result = vm.interpret(source.text());
+            else if (!interpret_cached(vm, path, source, &result))
+                return could_not_open(vm, path);
+            break;
+        case SourceFile::OpenResult::NOT_REGULAR: {
+            std::ifstream stream(path, std::ios::binary);
+            if (!stream) return could_not_open(vm, path);
+            result = vm.interpret(stream);
+            break;
+        }
+        default:
+            return could_not_open(vm, path);
+    }
+
+    if (result == InterpretResult::INTERPRET_COMPILE_ERROR) return 65;
+    if (result == InterpretResult::INTERPRET_RUNTIME_ERROR) return 70;
+    return 0;
+}
+
+// An in-memory FILE*, so a batch worker's output can be replayed in input
+// order once every script has finished.
+class MemoryStream {
+    char* mpBuffer = nullptr;
+    size_t mSize = 0;
+    FILE* mpStream;
+
+public:
+    MemoryStream() : mpStream(open_memstream(&mpBuffer, &mSize)) {}
+    ~MemoryStream() {
+        if (mpStream != nullptr) std::fclose(mpStream);
+        std::free(mpBuffer);
+    }
+    MemoryStream(const MemoryStream &) = delete;
+    MemoryStream &operator=(const MemoryStream &) = delete;
+
+    [[nodiscard]] FILE* get() const { return mpStream != nullptr ? mpStream : stderr; }
+    [[nodiscard]] std::string contents() const {
+        if (mpStream == nullptr) return {};
+        std::fflush(mpStream);
+        return {mpBuffer, mSize};
+    }
+};
+
+struct ScriptResult {
+    std::string output;
+    std::string errors;
+    int status = 0;
+};
+
+static void copy_settings(VM &vm, const VM &settings) {
+    vm.mParser.mFoldConstants = settings.mParser.mFoldConstants;
+    vm.mParser.mRegisterMode = settings.mParser.mRegisterMode;
+    vm.mParser.mBulkScan = settings.mParser.mBulkScan;
+    vm.mPeephole = settings.mPeephole;
+    vm.mProfile = settings.mProfile;
+    vm.mProfiler.mTiming = settings.mProfiler.mTiming;
+    vm.mTrace = settings.mTrace;
+    vm.mChecks = settings.mChecks;
+    vm.mSample = settings.mSample;
+    vm.mJit = settings.mJit;
+    vm.mJitVerify = settings.mJitVerify;
+    vm.mInputs = settings.mInputs;
+}
+
+// Runs every script on its own worker VM and prints what each one wrote,
+// in input order, as if they had run one after another, and merges their
+// samples into samples. Returns the status of the first script that failed,
+// or 0.
+static int run_batch(const VM &settings, const std::vector<std::string> &paths, int jobs, Sampler &samples) {
+    // no more workers than scripts, as run_work_stealing runs no more threads
+    jobs = static_cast<int>(std::min<size_t>(jobs, std::max<size_t>(paths.size(), 1)));
+    std::vector<std::unique_ptr<VM>> workers(jobs);
+    for (auto &worker : workers) {
+        worker = std::make_unique<VM>();
+        copy_settings(*worker, settings);
+        worker->mPrintResult = false;
+    }
+    std::vector<ScriptResult> results(paths.size());
+
+    const auto start = std::chrono::steady_clock::now();
+    run_work_stealing(paths.size(), jobs, [&](const int worker, const size_t index) {
+        VM &vm = *workers[worker];
+        const MemoryStream errors;
+        vm.mpErrorStream = errors.get();
+        vm.mParser.mpErrorStream = errors.get();
+
+        ScriptResult &result = results[index];
+        result.status = run_file(vm, paths[index].c_str());
+        if (result.status == 0) {
+            const MemoryStream output;
+            print_value(vm.mResult, output.get());
+            std::fputc('\n', output.get());
+            result.output = output.contents();
+        }
+        result.errors = errors.contents();
+    });
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    for (const auto &worker : workers)
+        samples.merge(worker->mSampler);
+
+    int status = 0;
+    size_t failed = 0;
+    for (size_t i = 0; i < results.size(); ++i) {
+        const ScriptResult &result = results[i];
+        if (!result.errors.empty()) {
+            std::fflush(stdout);
+            std::fputs(result.errors.c_str(), stderr);
+        }
+        std::fputs(result.output.c_str(), stdout);
+        if (result.status != 0) {
+            std::fflush(stdout);
+            std::fprintf(stderr, "[batch] %s exited with %d\n", paths[i].c_str(), result.status);
+            if (status == 0) status = result.status;
+            ++failed;
+        }
+    }
+    std::fflush(stdout);
+
+    std::fprintf(stderr, "[batch] %zu scripts, %zu failed, %.1f ms on %d threads (%.0f scripts/s)\n",
+                 paths.size(), failed, elapsed.count() * 1e3, jobs,
+                 static_cast<double>(paths.size()) / elapsed.count());
+    return status;
+}
+
+// One script path per line; blank lines are skipped.
+static bool read_manifest(const char* manifestPath, std::vector<std::string> &paths) {
+    std::ifstream manifest(manifestPath);
+    if (!manifest) return false;
+
+    std::string line;
+    while (std::getline(manifest, line)) {
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        if (!line.empty()) paths.push_back(line);
+    }
+    return true;
+}
+
+// HEX_INSTRUMENT turns on run-loop instrumentation without touching the
+// command line: a comma-separated list of trace, profile, profile-time and
+// checks. Returns false on an unknown name.
+static bool read_instrumentation(VM &vm, const std::string_view list) {
+    size_t start = 0;
+    while (start <= list.size()) {
+        const size_t end = std::min(list.find(',', start), list.size());
+        const std::string_view name = list.substr(start, end - start);
+        if (name == "trace")
+            vm.mTrace = true;
+        else if (name == "profile" || name == "profile-time") {
+            vm.mProfile = true;
+            vm.mProfiler.mTiming = vm.mProfiler.mTiming || name == "profile-time";
+        }
+        else if (name == "checks")
+            vm.mChecks = true;
+        else if (!name.empty()) {
+            std::cerr << "Unknown HEX_INSTRUMENT feature \"" << name << "\"." << std::endl;
+            return false;
+        }
+        start = end + 1;
     }
+    return true;
 }
 
-static void run_file(const char* path) {
-    std::stringstream buffer;
+// Stops sampling and writes what was collected to samplePath. Returns the
+// exit status, which only a write failure turns from status into 74.
+static int write_samples(const Sampler &samples, const int status) {
+    Sampler::stop();
 
-    // reading the file contents
-    std::ifstream fileStream(path);
-    if (fileStream)
-        buffer << fileStream.rdbuf();
-    else {
-        std::cerr << "Could not open file \"" << path << "\"." << std::endl;
-        exit(74);
+    FILE* out = std::fopen(samplePath, "w");
+    if (out == nullptr) {
+        std::fprintf(stderr, "Could not write sample profile \"%s\".\n", samplePath);
+        return status != 0 ? status : 74;
     }
-    fileStream.close();
+    samples.write(out);
+    std::fclose(out);
 
-    std::string source = buffer.str();
-    InterpretResult result = vm.interpret(source);
+    std::fprintf(stderr, "[sample] %llu samples written to %s\n",
+                 static_cast<unsigned long long>(samples.total()), samplePath);
+    return status;
+}
 
-    if (result == InterpretResult::INTERPRET_COMPILE_ERROR) exit(65);
-    if (result == InterpretResult::INTERPRET_RUNTIME_ERROR) exit(70);
+static int usage() {
+    std::cerr << "Usage: hex [--no-fold] [--peephole] [--registers] [--bulk-scan] [--cache]"
+                 " [--trace] [--checks] [--profile | --profile-time] [--sample FILE [--sample-hz N]] [--jit | --jit-verify] [--input NUMBER]... [--jobs N]"
+                 " [--manifest FILE] [path...]" << std::endl;
+    return 64;
 }
 
 int main(int argc, char *argv[]) {
-    if (argc == 1) {
-        repl();
+    std::vector<std::string> paths;
+    std::vector<Value> inputs; // $0, $1, ... in order
+    int jobs = 0;
+    int sampleFrequency = DEFAULT_SAMPLE_FREQUENCY;
+    bool batch = false;
+    VM vm;
+
+    if (const char* instrument = std::getenv("HEX_INSTRUMENT"); instrument != nullptr) {
+        if (!read_instrumentation(vm, instrument)) return 64;
+    }
+
+    for (int i = 1; i < argc; ++i) {
+        const std::string_view arg = argv[i];
+        if (arg == "--no-fold")
+            vm.mParser.mFoldConstants = false;
+        else if (arg == "--peephole")
+            vm.mPeephole = true;
+        else if (arg == "--registers")
+            vm.mParser.mRegisterMode = true;
+        else if (arg == "--bulk-scan")
+            vm.mParser.mBulkScan = true;
+        else if (arg == "--cache")
+            useCache = true;
+        else if (arg == "--trace")
+            vm.mTrace = true;
+        else if (arg == "--checks")
+            vm.mChecks = true;
+        else if (arg == "--profile" || arg == "--profile-time") {
+            vm.mProfile = true;
+            vm.mProfiler.mTiming = arg == "--profile-time";
+        }
+        else if (arg == "--sample" && i + 1 < argc) {
+            samplePath = argv[++i];
+            vm.mSample = true;
+        }
+        else if (arg == "--sample-hz" && i + 1 < argc) {
+            sampleFrequency = std::atoi(argv[++i]);
+            if (sampleFrequency < 1) return usage();
+        }
+        else if (arg == "--jit" || arg == "--jit-verify") {
+#ifndef JIT
+            std::cerr << "Built without HEX_JIT; " << arg << " has no effect." << std::endl;
+#endif
+            vm.mJit = true;
+            vm.mJitVerify = arg == "--jit-verify";
+        }
+        else if (arg == "--input" && i + 1 < argc) {
+            char* end;
+            const double input = std::strtod(argv[++i], &end);
+            if (end == argv[i] || *end != '\0') return usage();
+            inputs.push_back(Value::checked_number(input));
+        }
+        else if (arg == "--jobs" && i + 1 < argc) {
+            jobs = std::atoi(argv[++i]);
+            if (jobs < 1) return usage();
+            batch = true;
+        }
+        else if (arg == "--manifest" && i + 1 < argc) {
+            if (!read_manifest(argv[++i], paths)) {
+                std::cerr << "Could not open file \"" << argv[i] << "\"." << std::endl;
+                return 74;
+            }
+            batch = true;
+        }
+        else if (arg == "-" || !arg.starts_with("-"))
+            paths.emplace_back(argv[i]);
+        else
+            return usage();
     }
-    else if (argc == 2) {
-        run_file(argv[1]);
+    vm.mInputs = inputs;
+
+    if (vm.mSample && !Sampler::start(sampleFrequency)) {
+        std::cerr << "Could not start the sampling timer." << std::endl;
+        return 70;
     }
-    else {
-        std::cerr << "Usage: hex [path]" << std::endl;
+
+    int status = 0;
+    if (batch || paths.size() > 1) {
+        if (jobs == 0) jobs = static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+        status = run_batch(vm, paths, jobs, vm.mSampler);
     }
+    else if (paths.empty())
+        repl(vm);
+    else
+        status = run_file(vm, paths[0].c_str());
 
-    return 0;
+    if (vm.mSample) return write_samples(vm.mSampler, status);
+    return status;
 }
@@ -0,0 +1,172 @@
+﻿#include "optimizer.h"
+
+#include <vector>
+
+// CONSTANT_LONG is decoded as CONSTANT; the operand width is picked again
+// when the chunk is re-emitted.
+struct Instruction {
+    OpCode op;
+    Value constant; // only meaningful for instructions with a constant operand
+    int line;
+    uint8_t input; // INPUT only
+};
+
+static bool has_constant_operand(const OpCode op) {
+    return op == OpCode::CONSTANT || op == OpCode::CONSTANT_LONG || (op != OpCode::INPUT && instruction_size(op) == 2);
+}
+
+static OpCode unfused_op(const OpCode op) {
+    switch (op) {
+        case OpCode::ADD_CONSTANT: return OpCode::ADD;
+        case OpCode::SUBTRACT_CONSTANT: return OpCode::SUBTRACT;
+        case OpCode::MULTIPLY_CONSTANT: return OpCode::MULTIPLY;
+        case OpCode::DIVIDE_CONSTANT: return OpCode::DIVIDE;
+        default: return op;
+    }
+}
+
+// Appends one instruction to chunk and returns how many it took. Operands
+// past the one-byte range need CONSTANT_LONG, and a fused op then falls
+// back to CONSTANT_LONG plus the plain op.
+static int emit(Chunk *chunk, const Instruction &instruction) {
+    const auto [op, constant, line, input] = instruction;
+    if (op == OpCode::INPUT) {
+        chunk->write(static_cast<uint8_t>(op), line);
+        chunk->write(input, line);
+        return 1;
+    }
+    if (!has_constant_operand(op)) {
+        chunk->write(static_cast<uint8_t>(op), line);
+        return 1;
+    }
+
+    const size_t index = chunk->add_constant(constant);
+    if (index <= MAX_SHORT_CONSTANT) {
+        chunk->write(static_cast<uint8_t>(op), line);
+        chunk->write(static_cast<uint8_t>(index), line);
+        return 1;
+    }
+
+    chunk->write(static_cast<uint8_t>(OpCode::CONSTANT_LONG), line);
+    chunk->write(static_cast<uint8_t>(index & 0xFF), line);
+    chunk->write(static_cast<uint8_t>((index >> 8) & 0xFF), line);
+    chunk->write(static_cast<uint8_t>((index >> 16) & 0xFF), line);
+    if (op == OpCode::CONSTANT)
+        return 1;
+
+    chunk->write(static_cast<uint8_t>(unfused_op(op)), line);
+    return 2;
+}
+
+// Fused form of a binary op whose right operand is a constant, if it has one.
+static bool fused_constant_op(const OpCode op, OpCode *fused) {
+    switch (op) {
+        case OpCode::ADD: *fused = OpCode::ADD_CONSTANT; return true;
+        case OpCode::SUBTRACT: *fused = OpCode::SUBTRACT_CONSTANT; return true;
+        case OpCode::MULTIPLY: *fused = OpCode::MULTIPLY_CONSTANT; return true;
+        case OpCode::DIVIDE: *fused = OpCode::DIVIDE_CONSTANT; return true;
+        default: return false;
+    }
+}
+
+static bool is_constant(const Instruction &instruction, const double value) {
+    return instruction.op == OpCode::CONSTANT
+        && instruction.constant.raw_bits() == Value::number(value).raw_bits();
+}
+
+// Tries one pattern on the end of out. An instruction right before a binary
+// op is the tail of its right operand, so a CONSTANT there is the whole
+// right operand. Identities are only removed when they hold for every IEEE
+// input: x + 0 turns -0 into +0, so only x + (-0) and x - 0 qualify.
+static bool rewrite_tail(std::pmr::vector<Instruction> &out) {
+    if (out.size() < 2) return false;
+
+    Instruction &prev = out[out.size() - 2];
+    const Instruction &last = out.back();
+
+    switch (last.op) {
+        case OpCode::NEGATE:
+            if (prev.op == OpCode::CONSTANT) {
+                prev.constant = Value::number(-prev.constant.as_number());
+                out.pop_back();
+                return true;
+            }
+            if (prev.op == OpCode::NEGATE) {
+                out.resize(out.size() - 2);
+                return true;
+            }
+            return false;
+        case OpCode::MULTIPLY:
+        case OpCode::DIVIDE:
+            if (is_constant(prev, 1.0)) {
+                out.resize(out.size() - 2);
+                return true;
+            }
+            break;
+        case OpCode::ADD:
+            if (is_constant(prev, -0.0)) {
+                out.resize(out.size() - 2);
+                return true;
+            }
+            break;
+        case OpCode::SUBTRACT:
+            if (is_constant(prev, 0.0)) {
+                out.resize(out.size() - 2);
+                return true;
+            }
+            break;
+        default:
+            break;
+    }
+
+    OpCode fused;
+    if (prev.op == OpCode::CONSTANT && fused_constant_op(last.op, &fused)) {
+        prev.op = fused;
+        out.pop_back();
+        return true;
+    }
+
+    return false;
+}
+
+int peephole_optimize(Chunk *chunk, std::pmr::memory_resource* scratch) {
+    std::pmr::vector<Instruction> out(scratch);
+    out.reserve(chunk->count());
+    int before = 0;
+
+    for (int offset = 0; offset < chunk->count();) {
+        const auto op = static_cast<OpCode>(chunk->get_code_at(offset));
+        Instruction instruction{op == OpCode::CONSTANT_LONG ? OpCode::CONSTANT : op, Value::nix(), chunk->get_line(offset), 0};
+        if (has_constant_operand(op))
+            instruction.constant = chunk->get_constant_at(static_cast<int>(chunk->get_constant_index(offset)));
+        else if (op == OpCode::INPUT)
+            instruction.input = chunk->get_code_at(offset + 1);
+
+        out.push_back(instruction);
+        while (rewrite_tail(out)) {}
+
+        offset += instruction_size(op);
+        ++before;
+    }
+
+    // re-emit into the emptied chunk so only live constants survive; out
+    // holds copies of every operand it still needs
+    const ChunkFormat format = chunk->get_format();
+    const int inputCount = chunk->get_input_count();
+    chunk->clear();
+    chunk->set_format(format);
+    chunk->set_input_count(inputCount);
+    int after = 0;
+    int depth = 0;
+    int maxDepth = 0;
+    for (const Instruction &instruction : out) {
+        after += emit(chunk, instruction);
+
+        // a fused op split back up peaks one higher than its net effect
+        depth += stack_effect(instruction.op);
+        if (depth + 1 > maxDepth) maxDepth = depth + 1;
+    }
+    chunk->set_max_stack_depth(maxDepth);
+
+    return before - after;
+}
@@ -0,0 +1,10 @@
+﻿#pragma once
+
+#include <memory_resource>
+
+#include "chunk.h"
+
+// Rewrites chunk in place with peephole patterns, compacts its constant pool
+// and rebuilds the line table. Working memory comes from scratch. Returns the
+// number of instructions removed.
+int peephole_optimize(Chunk *chunk, std::pmr::memory_resource* scratch = std::pmr::get_default_resource());
@@ -0,0 +1,108 @@
+﻿#include "profiler.h"
+
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define TICK_UNIT "cycles"
+static uint64_t read_ticks() {
+    return __rdtsc();
+}
+#else
+#define TICK_UNIT "ns"
+static uint64_t read_ticks() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+#endif
+
+void Profiler::begin_run(const ChunkFormat format) {
+    if (mpPairs == nullptr) mpPairs = std::make_unique<std::array<uint64_t, 256 * 256>>();
+    if (format != mFormat) reset();
+    mFormat = format;
+    mPrevious = -1;
+}
+
+void Profiler::record(const uint8_t opcode) {
+    ++mCounts[opcode];
+    if (mPrevious >= 0)
+        ++(*mpPairs)[mPrevious * 256 + opcode];
+
+    if (mTiming) {
+        const uint64_t now = read_ticks();
+        if (mPrevious >= 0)
+            mTicks[mPrevious] += now - mStamp;
+        mStamp = now;
+    }
+
+    mPrevious = opcode;
+}
+
+void Profiler::end_run() {
+    if (mTiming && mPrevious >= 0)
+        mTicks[mPrevious] += read_ticks() - mStamp;
+    mPrevious = -1;
+}
+
+void Profiler::reset() {
+    mCounts.fill(0);
+    if (mpPairs != nullptr) mpPairs->fill(0);
+    mTicks.fill(0);
+    mPrevious = -1;
+}
+
+void Profiler::report(FILE* out) const {
+    uint64_t total = 0;
+    uint64_t totalTicks = 0;
+    std::vector<int> opcodes;
+    for (int opcode = 0; opcode < 256; ++opcode) {
+        if (mCounts[opcode] == 0) continue;
+        total += mCounts[opcode];
+        totalTicks += mTicks[opcode];
+        opcodes.push_back(opcode);
+    }
+    if (total == 0 || mpPairs == nullptr) return;
+    const auto &pairCounts = *mpPairs;
+
+    // by time when it was measured, otherwise by count
+    std::sort(opcodes.begin(), opcodes.end(), [this](const int a, const int b) {
+        if (mTiming && mTicks[a] != mTicks[b]) return mTicks[a] > mTicks[b];
+        return mCounts[a] > mCounts[b];
+    });
+
+    std::fprintf(out, "== profile: %llu instructions ==\n", static_cast<unsigned long long>(total));
+    std::fprintf(out, "%-22s %12s %7s", "opcode", "count", "%");
+    if (mTiming) std::fprintf(out, " %14s %7s %10s", TICK_UNIT, "%", "per op");
+    std::fprintf(out, "\n");
+    for (const int opcode : opcodes) {
+        std::fprintf(out, "%-22s %12llu %6.2f%%", opcode_name(mFormat, static_cast<uint8_t>(opcode)),
+                     static_cast<unsigned long long>(mCounts[opcode]),
+                     100.0 * static_cast<double>(mCounts[opcode]) / static_cast<double>(total));
+        if (mTiming)
+            std::fprintf(out, " %14llu %6.2f%% %10.1f", static_cast<unsigned long long>(mTicks[opcode]),
+                         totalTicks ? 100.0 * static_cast<double>(mTicks[opcode]) / static_cast<double>(totalTicks) : 0.0,
+                         static_cast<double>(mTicks[opcode]) / static_cast<double>(mCounts[opcode]));
+        std::fprintf(out, "\n");
+    }
+
+    std::vector<int> pairs;
+    uint64_t pairTotal = 0;
+    for (int pair = 0; pair < 256 * 256; ++pair) {
+        if (pairCounts[pair] == 0) continue;
+        pairTotal += pairCounts[pair];
+        pairs.push_back(pair);
+    }
+    std::sort(pairs.begin(), pairs.end(), [&pairCounts](const int a, const int b) { return pairCounts[a] > pairCounts[b]; });
+
+    std::fprintf(out, "== opcode pairs ==\n");
+    for (size_t i = 0; i < pairs.size() && i < 20; ++i) {
+        const int pair = pairs[i];
+        std::fprintf(out, "%-22s -> %-22s %12llu %6.2f%%\n",
+                     opcode_name(mFormat, static_cast<uint8_t>(pair / 256)),
+                     opcode_name(mFormat, static_cast<uint8_t>(pair % 256)),
+                     static_cast<unsigned long long>(pairCounts[pair]),
+                     100.0 * static_cast<double>(pairCounts[pair]) / static_cast<double>(pairTotal));
+    }
+}
@@ -0,0 +1,31 @@
+﻿#pragma once
+
+#include <array>
+#include <cstdio>
+#include <memory>
+
+#include "chunk.h"
+
+// Execution counts per opcode and per adjacent opcode pair, plus optional
+// per-handler timing. The VM feeds it from the dispatch point of its
+// RUN_PROFILE run loops; a handler's time runs from its dispatch to the next
+// one.
+class Profiler {
+    std::array<uint64_t, 256> mCounts{};
+    // previous * 256 + current; 512 KB, so only allocated by the first
+    // begin_run rather than carried by every VM
+    std::unique_ptr<std::array<uint64_t, 256 * 256>> mpPairs;
+    std::array<uint64_t, 256> mTicks{};
+    ChunkFormat mFormat = ChunkFormat::STACK;
+    int mPrevious = -1;
+    uint64_t mStamp = 0;
+
+public:
+    bool mTiming = false;
+
+    void begin_run(ChunkFormat format);
+    void record(uint8_t opcode);
+    void end_run();
+    void report(FILE* out) const;
+    void reset();
+};
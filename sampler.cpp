@@ -0,0 +1,100 @@
+﻿#include "sampler.h"
+
+#include <algorithm>
+#include <csignal>
+#include <sys/time.h>
+
+namespace {
+// The sampler running a chunk on this thread. ITIMER_PROF signals the thread
+// that used up the CPU time, so the handler reads its own thread's slot.
+thread_local Sampler* tpRunning = nullptr;
+std::atomic<uint64_t> gUnattributed{0};
+}
+
+// Signal handler: only lock-free atomics and the thread's own slot.
+void Sampler::take_sample(int) {
+    const Sampler* sampler = tpRunning;
+    if (sampler == nullptr) {
+        gUnattributed.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    const uint8_t* ip = sampler->mIp.load(std::memory_order_relaxed);
+    if (ip == nullptr || ip < sampler->mChunk.code || ip >= sampler->mChunk.code + sampler->mChunk.codeSize) {
+        gUnattributed.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    sampler->mpHits[ip - sampler->mChunk.code].fetch_add(1, std::memory_order_relaxed);
+}
+
+bool Sampler::start(const int frequency) {
+    struct sigaction action{};
+    action.sa_handler = take_sample;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    if (sigaction(SIGPROF, &action, nullptr) != 0) return false;
+
+    const long interval = std::max(1L, 1000000L / frequency);
+    const itimerval timer{{interval / 1000000, interval % 1000000}, {interval / 1000000, interval % 1000000}};
+    return setitimer(ITIMER_PROF, &timer, nullptr) == 0;
+}
+
+void Sampler::stop() {
+    constexpr itimerval off{};
+    setitimer(ITIMER_PROF, &off, nullptr);
+    // a signal already pending must not take the default action, which exits
+    std::signal(SIGPROF, SIG_IGN);
+}
+
+void Sampler::begin_run(const ChunkView &chunk) {
+    if (mHitCapacity < chunk.codeSize) {
+        mpHits = std::make_unique<std::atomic<uint32_t>[]>(chunk.codeSize);
+        mHitCapacity = chunk.codeSize;
+    }
+    for (size_t offset = 0; offset < chunk.codeSize; ++offset)
+        mpHits[offset].store(0, std::memory_order_relaxed);
+
+    mChunk = chunk;
+    mIp.store(nullptr, std::memory_order_relaxed);
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+    tpRunning = this;
+}
+
+void Sampler::end_run() {
+    tpRunning = nullptr;
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+
+    for (size_t offset = 0; offset < mChunk.codeSize; ++offset) {
+        const uint32_t hits = mpHits[offset].load(std::memory_order_relaxed);
+        if (hits == 0) continue;
+
+        const int line = find_line(mChunk.lines, mChunk.lineCount, static_cast<int>(offset));
+        std::string stack = mScript;
+        stack += ";line ";
+        stack += std::to_string(line);
+        stack += ';';
+        stack += opcode_name(mChunk.format, mChunk.code[offset]);
+        mStacks[stack] += hits;
+    }
+    mChunk = {};
+}
+
+void Sampler::merge(const Sampler &other) {
+    for (const auto &[stack, samples] : other.mStacks)
+        mStacks[stack] += samples;
+}
+
+uint64_t Sampler::total() const {
+    uint64_t total = gUnattributed.load(std::memory_order_relaxed);
+    for (const auto &[stack, samples] : mStacks)
+        total += samples;
+    return total;
+}
+
+void Sampler::write(FILE* out) const {
+    for (const auto &[stack, samples] : mStacks)
+        std::fprintf(out, "%s %llu\n", stack.c_str(), static_cast<unsigned long long>(samples));
+
+    if (const uint64_t unattributed = gUnattributed.load(std::memory_order_relaxed); unattributed > 0)
+        std::fprintf(out, "(outside the run loop) %llu\n", static_cast<unsigned long long>(unattributed));
+}
@@ -0,0 +1,43 @@
+﻿#pragma once
+
+#include <atomic>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <string>
+
+#include "chunk.h"
+
+// Statistical profiler. A SIGPROF interval timer interrupts the process at
+// a fixed rate of CPU time, and the handler charges the sample to the
+// instruction the interrupted thread's VM is dispatching. After each run the
+// samples are folded per source line and opcode into collapsed stacks
+// ("path;line 3;OP_ADD 17"), the input of flamegraph.pl, inferno and
+// speedscope. The only cost inside the run loop is one store per dispatch in
+// its RUN_SAMPLE specializations.
+class Sampler {
+    ChunkView mChunk{};
+    std::unique_ptr<std::atomic<uint32_t>[]> mpHits; // samples per code offset of mChunk
+    size_t mHitCapacity = 0;
+    std::map<std::string, uint64_t> mStacks; // collapsed stack -> samples
+
+    static void take_sample(int signal);
+
+public:
+    std::atomic<const uint8_t*> mIp{nullptr}; // published by the RUN_SAMPLE loops at every dispatch
+    std::string mScript = "script"; // root frame of every stack
+
+    // Arms the process-wide timer at frequency samples per CPU second.
+    [[nodiscard]] static bool start(int frequency);
+    static void stop();
+
+    // Bracket one run of chunk on the calling thread; samples outside any
+    // run are counted as unattributed.
+    void begin_run(const ChunkView &chunk);
+    void end_run();
+
+    void merge(const Sampler &other);
+    [[nodiscard]] uint64_t total() const;
+    // Writes this sampler's stacks, then the process-wide unattributed ones.
+    void write(FILE* out) const;
+};
@@ -0,0 +1,162 @@
+﻿#include "scan_kernels.h"
+
+#include <bit>
+#include <cstdlib>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAS_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+static bool is_blank(const char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+static bool is_digit(const char c) {
+    return c >= '0' && c <= '9';
+}
+
+static bool is_identifier(const char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_' || is_digit(c);
+}
+
+static size_t scalar_blanks(const char* begin, const char* end, int* newlines) {
+    const char* p = begin;
+    for (; p < end && is_blank(*p); ++p)
+        *newlines += *p == '\n';
+    return p - begin;
+}
+
+static size_t scalar_identifier(const char* begin, const char* end) {
+    const char* p = begin;
+    while (p < end && is_identifier(*p)) ++p;
+    return p - begin;
+}
+
+static size_t scalar_digits(const char* begin, const char* end) {
+    const char* p = begin;
+    while (p < end && is_digit(*p)) ++p;
+    return p - begin;
+}
+
+static size_t scalar_string_body(const char* begin, const char* end, int* newlines) {
+    const char* p = begin;
+    for (; p < end && *p != '"'; ++p)
+        *newlines += *p == '\n';
+    return p - begin;
+}
+
+static constexpr ScanKernels scalarKernels = {
+    "scalar", scalar_blanks, scalar_identifier, scalar_digits, scalar_string_body,
+};
+
+#ifdef HAS_X86_KERNELS
+
+// The vector kernels build a bitmask of matching bytes per block, stop at the
+// first clear (or, for strings, set) bit and hand the last partial block to
+// the scalar loop, so they never read past end.
+
+#define DEFINE_VECTOR_KERNELS(PREFIX, TARGET, VEC, WIDTH, LOAD, SET1, CMPEQ, CMPGT, OR, AND, MOVEMASK) \
+    TARGET static uint32_t PREFIX##_blank_mask(const VEC chunk) { \
+        const VEC blanks = OR(OR(CMPEQ(chunk, SET1(' ')), CMPEQ(chunk, SET1('\t'))), \
+                              OR(CMPEQ(chunk, SET1('\r')), CMPEQ(chunk, SET1('\n')))); \
+        return static_cast<uint32_t>(MOVEMASK(blanks)); \
+    } \
+    TARGET static uint32_t PREFIX##_digit_mask(const VEC chunk) { \
+        return static_cast<uint32_t>(MOVEMASK(AND(CMPGT(chunk, SET1('0' - 1)), CMPGT(SET1('9' + 1), chunk)))); \
+    } \
+    TARGET static size_t PREFIX##_blanks(const char* begin, const char* end, int* newlines) { \
+        const char* p = begin; \
+        for (; end - p >= WIDTH; p += WIDTH) { \
+            const VEC chunk = LOAD(reinterpret_cast<const VEC*>(p)); \
+            const uint64_t run = ~static_cast<uint64_t>(PREFIX##_blank_mask(chunk)); \
+            const uint32_t lines = static_cast<uint32_t>(MOVEMASK(CMPEQ(chunk, SET1('\n')))); \
+            if (run != ~0ull << WIDTH) { \
+                const int length = std::countr_zero(run); \
+                *newlines += std::popcount(lines & ((1ull << length) - 1)); \
+                return p - begin + length; \
+            } \
+            *newlines += std::popcount(lines); \
+        } \
+        return p - begin + scalar_blanks(p, end, newlines); \
+    } \
+    TARGET static size_t PREFIX##_identifier(const char* begin, const char* end) { \
+        const char* p = begin; \
+        for (; end - p >= WIDTH; p += WIDTH) { \
+            const VEC chunk = LOAD(reinterpret_cast<const VEC*>(p)); \
+            const VEC lower = OR(chunk, SET1(0x20)); \
+            const VEC letters = AND(CMPGT(lower, SET1('a' - 1)), CMPGT(SET1('z' + 1), lower)); \
+            const uint32_t matches = static_cast<uint32_t>(MOVEMASK(OR(letters, CMPEQ(chunk, SET1('_'))))) \
+                                     | PREFIX##_digit_mask(chunk); \
+            const uint64_t run = ~static_cast<uint64_t>(matches); \
+            if (run != ~0ull << WIDTH) \
+                return p - begin + std::countr_zero(run); \
+        } \
+        return p - begin + scalar_identifier(p, end); \
+    } \
+    TARGET static size_t PREFIX##_digits(const char* begin, const char* end) { \
+        const char* p = begin; \
+        for (; end - p >= WIDTH; p += WIDTH) { \
+            const uint64_t run = ~static_cast<uint64_t>(PREFIX##_digit_mask(LOAD(reinterpret_cast<const VEC*>(p)))); \
+            if (run != ~0ull << WIDTH) \
+                return p - begin + std::countr_zero(run); \
+        } \
+        return p - begin + scalar_digits(p, end); \
+    } \
+    TARGET static size_t PREFIX##_string_body(const char* begin, const char* end, int* newlines) { \
+        const char* p = begin; \
+        for (; end - p >= WIDTH; p += WIDTH) { \
+            const VEC chunk = LOAD(reinterpret_cast<const VEC*>(p)); \
+            const uint32_t quotes = static_cast<uint32_t>(MOVEMASK(CMPEQ(chunk, SET1('"')))); \
+            const uint32_t lines = static_cast<uint32_t>(MOVEMASK(CMPEQ(chunk, SET1('\n')))); \
+            if (quotes != 0) { \
+                const int length = std::countr_zero(quotes); \
+                *newlines += std::popcount(lines & ((1ull << length) - 1)); \
+                return p - begin + length; \
+            } \
+            *newlines += std::popcount(lines); \
+        } \
+        return p - begin + scalar_string_body(p, end, newlines); \
+    }
+
+DEFINE_VECTOR_KERNELS(sse2, __attribute__((target("sse2"))), __m128i, 16,
+                      _mm_loadu_si128, _mm_set1_epi8, _mm_cmpeq_epi8, _mm_cmpgt_epi8,
+                      _mm_or_si128, _mm_and_si128, _mm_movemask_epi8)
+
+DEFINE_VECTOR_KERNELS(avx2, __attribute__((target("avx2"))), __m256i, 32,
+                      _mm256_loadu_si256, _mm256_set1_epi8, _mm256_cmpeq_epi8, _mm256_cmpgt_epi8,
+                      _mm256_or_si256, _mm256_and_si256, _mm256_movemask_epi8)
+
+#undef DEFINE_VECTOR_KERNELS
+
+static constexpr ScanKernels sse2Kernels = {
+    "sse2", sse2_blanks, sse2_identifier, sse2_digits, sse2_string_body,
+};
+
+static constexpr ScanKernels avx2Kernels = {
+    "avx2", avx2_blanks, avx2_identifier, avx2_digits, avx2_string_body,
+};
+
+#endif
+
+static const ScanKernels &select_kernels() {
+    const char* forced = std::getenv("HEX_SCAN_KERNEL");
+    const std::string_view choice = forced ? forced : "";
+    if (choice == "scalar") return scalarKernels;
+
+#ifdef HAS_X86_KERNELS
+    __builtin_cpu_init();
+    const bool avx2 = __builtin_cpu_supports("avx2");
+    const bool sse2 = __builtin_cpu_supports("sse2");
+    if (choice == "sse2" && sse2) return sse2Kernels;
+    if (avx2 && choice != "sse2") return avx2Kernels;
+    if (sse2) return sse2Kernels;
+#endif
+
+    return scalarKernels;
+}
+
+const ScanKernels &scan_kernels() {
+    static const ScanKernels &kernels = select_kernels();
+    return kernels;
+}
@@ -0,0 +1,22 @@
+﻿#pragma once
+
+#include "common.h"
+
+// Bulk character-class scans used by Scanner. Every kernel looks at
+// [begin, end) only and returns the length of the leading run it matched;
+// the ones that can cross lines add the newlines they passed to *newlines.
+struct ScanKernels {
+    const char* name;
+    // ' ', '\t', '\r', '\n'
+    size_t (*blanks)(const char* begin, const char* end, int* newlines);
+    // [A-Za-z0-9_]
+    size_t (*identifier)(const char* begin, const char* end);
+    // [0-9]
+    size_t (*digits)(const char* begin, const char* end);
+    // everything up to, not including, the next '"'
+    size_t (*string_body)(const char* begin, const char* end, int* newlines);
+};
+
+// The widest implementation this CPU runs (AVX2, SSE2 or scalar), picked on
+// first use. HEX_SCAN_KERNEL=scalar|sse2|avx2 forces one, for comparisons.
+[[nodiscard]] const ScanKernels &scan_kernels();
@@ -1,10 +1,116 @@
 ﻿#include "scanner.h"
 
+#include <algorithm>
+#include <array>
 #include <cstring>
-#include <format>
 
-bool Scanner::is_at_end() const {
-    return mCurrent == mSource.end();
+struct Keyword {
+    std::string_view text;
+    TokenType type;
+};
+
+static constexpr std::array keywords = {
+    Keyword{"and", TokenType::AND},
+    Keyword{"cast", TokenType::RETURN},
+    Keyword{"else", TokenType::ELSE},
+    Keyword{"false", TokenType::FALSE},
+    Keyword{"for", TokenType::FOR},
+    Keyword{"grimoire", TokenType::CLASS},
+    Keyword{"if", TokenType::IF},
+    Keyword{"matron", TokenType::SUPER},
+    Keyword{"nix", TokenType::NIL},
+    Keyword{"or", TokenType::OR},
+    Keyword{"rune", TokenType::VAR},
+    Keyword{"spell", TokenType::CLASS},
+    Keyword{"summon", TokenType::PRINT},
+    Keyword{"this", TokenType::THIS},
+    Keyword{"true", TokenType::TRUE},
+    Keyword{"while", TokenType::WHILE},
+};
+
+static constexpr size_t KEYWORD_SLOTS = 32;
+
+static constexpr size_t keyword_length_bound(const bool longest) {
+    size_t bound = longest ? 0 : SIZE_MAX;
+    for (const Keyword &keyword : keywords)
+        bound = longest ? std::max(bound, keyword.text.size()) : std::min(bound, keyword.text.size());
+    return bound;
+}
+
+static constexpr size_t MIN_KEYWORD_LENGTH = keyword_length_bound(false);
+static constexpr size_t MAX_KEYWORD_LENGTH = keyword_length_bound(true);
+
+// Mixes the length and the first, second and last characters, which is
+// enough to tell the keywords apart once the seed is right.
+static constexpr uint32_t keyword_hash(const std::string_view word, const uint32_t seed) {
+    uint32_t hash = seed ^ static_cast<uint32_t>(word.size());
+    hash = (hash ^ static_cast<uint8_t>(word[0])) * 16777619u;
+    hash = (hash ^ static_cast<uint8_t>(word[1])) * 16777619u;
+    hash = (hash ^ static_cast<uint8_t>(word.back())) * 16777619u;
+    return hash ^ (hash >> 15);
+}
+
+struct KeywordTable {
+    uint32_t seed;
+    std::array<int8_t, KEYWORD_SLOTS> slots; // index into keywords, or -1
+};
+
+// Searches for the first seed that puts every keyword in its own slot.
+static constexpr KeywordTable make_keyword_table() {
+    for (uint32_t seed = 0; seed < 100000; ++seed) {
+        KeywordTable table{seed, {}};
+        table.slots.fill(-1);
+
+        bool collision = false;
+        for (size_t i = 0; i < keywords.size() && !collision; ++i) {
+            int8_t &slot = table.slots[keyword_hash(keywords[i].text, seed) % KEYWORD_SLOTS];
+            collision = slot >= 0;
+            slot = static_cast<int8_t>(i);
+        }
+        if (!collision) return table;
+    }
+    return {UINT32_MAX, {}};
+}
+
+static constexpr KeywordTable keywordTable = make_keyword_table();
+static_assert(keywordTable.seed != UINT32_MAX, "no perfect hash seed for the keyword table");
+static_assert(MIN_KEYWORD_LENGTH >= 2, "keyword_hash reads two leading characters");
+
+// Makes at least needed unread bytes available, short only at end of input.
+// Everything from mStart on is carried over into the refilled buffer.
+bool Scanner::refill(const size_t needed) {
+    if (mpStream == nullptr) return false;
+    if (!*mpStream) return static_cast<size_t>(mEnd - mCurrent) >= needed;
+
+    const size_t startOffset = mStart ? mStart - mBuffer.data() : 0;
+    const size_t currentOffset = mCurrent ? mCurrent - mBuffer.data() : 0;
+    const size_t kept = mStart ? mEnd - mStart : 0;
+
+    // the parser may still hold a view into the current buffer; only rewrite
+    // it in place once the last token came from elsewhere
+    if (mpTokenBuffer == mBuffer.data() && !mBuffer.empty()) {
+        mSpareBuffer.assign(mStart, mEnd);
+        std::swap(mBuffer, mSpareBuffer);
+    }
+    else if (kept > 0)
+        std::memmove(mBuffer.data(), mBuffer.data() + startOffset, kept);
+    mBuffer.resize(kept);
+
+    while (mBuffer.size() - (currentOffset - startOffset) < needed && *mpStream) {
+        const size_t filled = mBuffer.size();
+        mBuffer.resize(filled + STREAM_BLOCK_SIZE);
+        mpStream->read(mBuffer.data() + filled, STREAM_BLOCK_SIZE);
+        mBuffer.resize(filled + static_cast<size_t>(mpStream->gcount()));
+    }
+
+    mStart = mBuffer.data();
+    mCurrent = mStart + (currentOffset - startOffset);
+    mEnd = mStart + mBuffer.size();
+    return static_cast<size_t>(mEnd - mCurrent) >= needed;
+}
+
+bool Scanner::is_at_end() {
+    return mCurrent == mEnd && !refill(1);
 }
 
 char Scanner::advance() {
@@ -21,24 +127,55 @@ bool Scanner::match(const char expected) {
     return true;
 }
 
+static bool is_digit(const char c) {
+    return c >= '0' && c <= '9';
+}
+
+static bool is_alpha(const char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+}
+
+static bool is_blank(const char c) {
+    return c == ' ' || c == '\r' || c == '\t' || c == '\n';
+}
+
+// Most runs are a few bytes long, too short for a vector load to pay off, so
+// the first SHORT_RUN bytes are walked inline. Returns true when the run
+// continues past them and should be handed to the kernel.
+static constexpr ptrdiff_t SHORT_RUN = 16;
+
+template <typename Predicate>
+static bool walk_short_run(const char*& current, const char* end, Predicate matches, int &newlines) {
+    const char* limit = current + std::min(SHORT_RUN, end - current);
+    for (; current < limit; ++current) {
+        if (!matches(*current)) return false;
+        newlines += *current == '\n';
+    }
+    return current != end;
+}
+
 void Scanner::skip_whitespace() {
     for (;;) {
-        switch (char c = peek()) {
+        mStart = mCurrent; // nothing before here needs to survive a refill
+        switch (peek()) {
             case ' ':
             case '\r':
             case '\t':
-                advance();
-                break;
-            case '\n':
-                ++mLine;
-                advance();
+            case '\n': {
+                int newlines = 0;
+                if (walk_short_run(mCurrent, mEnd, is_blank, newlines))
+                    mCurrent += mpKernels->blanks(mCurrent, mEnd, &newlines);
+                mLine += newlines;
                 break;
+            }
             case '/':
-                if (peek_next() == '/')
-                    while (peek() != '\n' && !is_at_end())
-                        advance();
-                else
-                    return;
+                if (peek_next() != '/') return;
+                // a comment runs to the newline, which the next pass consumes
+                do {
+                    const void* newline = std::memchr(mCurrent, '\n', mEnd - mCurrent);
+                    mCurrent = newline ? static_cast<const char*>(newline) : mEnd;
+                    mStart = mCurrent;
+                } while (mCurrent == mEnd && !is_at_end());
                 break;
             default:
                 return;
@@ -46,45 +183,35 @@ void Scanner::skip_whitespace() {
     }
 }
 
-char Scanner::peek() const {
+char Scanner::peek() {
+    if (is_at_end()) return '\0';
     return *mCurrent;
 }
 
-char Scanner::peek_next() const {
-    if (is_at_end()) return '\0';
-    const std::string::iterator next_it = mCurrent + 1;
-    return *next_it;
+char Scanner::peek_next() {
+    if (mEnd - mCurrent < 2 && !refill(2)) return '\0';
+    return mCurrent[1];
 }
 
-TokenType Scanner::check_keyword(const int start, const int length, const std::string_view rest, const TokenType type) const {
-    if (mCurrent - mStart == start + length) {
-        const auto keywordBegin = mStart + start;
-        const auto keywordEnd = keywordBegin + length;
+Token Scanner::make_token(const TokenType type) {
+    if (mpStream != nullptr) mpTokenBuffer = mBuffer.data();
 
-        if (std::equal(keywordBegin, keywordEnd, rest.begin(), rest.end()))
-            return type;
-    }
-
-    return TokenType::IDENTIFIER;
-}
-
-
-Token Scanner::make_token(const TokenType type) const {
-    Token token {type, std::string(mStart, mCurrent), mLine};
+    Token token {type, std::string_view(mStart, mCurrent), mLine};
     return token;
 }
 
-Token Scanner::make_error_token(const std::string &message) const {
+Token Scanner::make_error_token(const std::string_view message) const {
     Token token { TokenType::ERROR, message, mLine};
     return token;
 }
 
 Token Scanner::make_string() {
-    while (peek() != '"' && !is_at_end()) {
-        if (peek() == '\n')
-            ++mLine;
-        advance();
-    }
+    int newlines = 0;
+    do {
+        if (walk_short_run(mCurrent, mEnd, [](const char c) { return c != '"'; }, newlines))
+            mCurrent += mpKernels->string_body(mCurrent, mEnd, &newlines);
+    } while (mCurrent == mEnd && !is_at_end());
+    mLine += newlines;
 
     if (is_at_end()) return make_error_token("Unterminated string");
 
@@ -93,73 +220,51 @@ Token Scanner::make_string() {
     return make_token(TokenType::STRING);
 }
 
-static bool is_digit(const char c) {
-    return c >= '0' && c <= '9';
-}
-
-static bool is_alpha(const char c) {
-    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+void Scanner::skip_digits() {
+    int newlines = 0;
+    do {
+        if (walk_short_run(mCurrent, mEnd, is_digit, newlines))
+            mCurrent += mpKernels->digits(mCurrent, mEnd);
+    } while (mCurrent == mEnd && !is_at_end());
 }
 
 Token Scanner::make_number() {
-    while (is_digit(peek())) advance();
+    skip_digits();
 
     // look for fractional part
     if (peek() == '.' && is_digit(peek_next())) {
         advance();
-
-        while (is_digit(peek())) advance();
+        skip_digits();
     }
 
     return make_token(TokenType::NUMBER);
 }
 
-TokenType Scanner::identifier_type() {
-    switch (*mStart) {
-        case 'a': return check_keyword(1, 2, "nd", TokenType::AND);
-        case 'c': return check_keyword(1, 3, "ast", TokenType::RETURN);
-        case 'e': return check_keyword(1, 3, "lse", TokenType::ELSE);
-        case 'f':
-            if (mCurrent - mStart > 1) {
-                switch (char newChar = *(mStart + 1)) {
-                    case 'a': return check_keyword(2, 3, "lse", TokenType::FALSE);
-                    case 'o': return check_keyword(2, 1, "r", TokenType::FOR);
-                    default: return TokenType::ERROR;
-                }
-            }
-            break;
-        case 'g': return check_keyword(1, 7, "rimoire", TokenType::CLASS);
-        case 'i': return check_keyword(1, 1, "f", TokenType::IF);
-        case 'm': return check_keyword(1, 5, "atron", TokenType::SUPER);
-        case 'n': return check_keyword(1, 2, "ix", TokenType::NIL);
-        case 'o': return check_keyword(1, 1, "r", TokenType::OR);
-        case 'r': return check_keyword(1, 3, "une", TokenType::VAR);
-        case 's':
-            if (mCurrent - mStart > 1) {
-                switch (char newChar = *(mStart + 1)) {
-                    case 'p': return check_keyword(2, 3, "ell", TokenType::CLASS);
-                    case 'u': return check_keyword(2, 4, "mmon", TokenType::PRINT);
-                    default: return TokenType::ERROR;
-                }
-            }
-            break;
-        case 't':
-            if (mCurrent - mStart > 1) {
-                switch (char newChar = *(mStart + 1)) {
-                    case 'h': return check_keyword(2, 2, "is", TokenType::THIS);
-                    case 'r': return check_keyword(2, 2, "ue", TokenType::TRUE);
-                    default: return TokenType::ERROR;
-                }
-            }
-            break;
-        case 'w': return check_keyword(1, 4, "hile", TokenType::WHILE);
+// $ followed by the input's index
+Token Scanner::make_input() {
+    if (!is_digit(peek())) return make_error_token("Expect input index after '$'");
+    skip_digits();
+    return make_token(TokenType::INPUT);
+}
 
-        default: return TokenType::ERROR;
-    }
+TokenType Scanner::identifier_type() {
+    const std::string_view word(mStart, mCurrent);
+    if (word.size() < MIN_KEYWORD_LENGTH || word.size() > MAX_KEYWORD_LENGTH)
+        return TokenType::IDENTIFIER;
+
+    const int8_t slot = keywordTable.slots[keyword_hash(word, keywordTable.seed) % KEYWORD_SLOTS];
+    if (slot < 0 || keywords[slot].text != word)
+        return TokenType::IDENTIFIER;
+    return keywords[slot].type;
 }
 
 Token Scanner::make_identifier() {
-    while (is_alpha(peek()) || is_digit(peek())) advance();
+    const auto isIdentifier = [](const char c) { return is_alpha(c) || is_digit(c); };
+    int newlines = 0;
+    do {
+        if (walk_short_run(mCurrent, mEnd, isIdentifier, newlines))
+            mCurrent += mpKernels->identifier(mCurrent, mEnd);
+    } while (mCurrent == mEnd && !is_at_end());
     return make_token(identifier_type());
 }
 
@@ -193,6 +298,7 @@ Token Scanner::scan_token() {
         case '<': return make_token(match('=') ? TokenType::LESS_EQUAL : TokenType::LESS);
         case '>': return make_token(match('=') ? TokenType::GREATER_EQUAL : TokenType::GREATER);
         case '"': return make_string();
+        case '$': return make_input();
 
         default: return make_error_token("Unexpected character");
     }
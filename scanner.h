@@ -1,6 +1,10 @@
 ﻿#pragma once
 
+#include <istream>
+#include <vector>
+
 #include "common.h"
+#include "scan_kernels.h"
 
 enum class TokenType : uint8_t {
     LEFT_PAREN, RIGHT_PAREN,
@@ -13,7 +17,7 @@ enum class TokenType : uint8_t {
     GREATER, GREATER_EQUAL,
     LESS, LESS_EQUAL,
 
-    IDENTIFIER, STRING, NUMBER,
+    IDENTIFIER, STRING, NUMBER, INPUT,
 
     AND, CLASS, ELSE, FALSE,
     FOR, FUN, IF, NIL, OR,
@@ -24,37 +28,61 @@ enum class TokenType : uint8_t {
     END_OF_FILE,
 };
 
+// lexeme views either the scanned source or, for ERROR tokens, a static
+// message, so the source must outlive every token scanned from it
 struct Token {
     TokenType type;
-    std::string lexeme;
+    std::string_view lexeme;
     int line = -1;
 };
 
+// Scans either a complete source buffer owned by the caller, or a stream read
+// in STREAM_BLOCK_SIZE blocks. When streaming, the block holding the last
+// returned token stays alive until the next refill, so the parser's current
+// and previous tokens are always valid while memory stays bounded.
 class Scanner {
-    std::string::iterator mStart;
-    std::string::iterator mCurrent;
-    std::string mSource;
+    const char* mStart;
+    const char* mCurrent;
+    const char* mEnd;
     int mLine;
+    const ScanKernels* mpKernels = &scan_kernels();
+
+    // streaming mode only
+    std::istream* mpStream = nullptr;
+    std::vector<char> mBuffer;
+    std::vector<char> mSpareBuffer;
+    const char* mpTokenBuffer = nullptr; // data() of the buffer the last token came from
 
-    [[nodiscard]] bool is_at_end() const;
-    [[nodiscard]] Token make_token(TokenType type) const;
-    [[nodiscard]] Token make_error_token(const std::string &message) const;
+    [[nodiscard]] bool refill(size_t needed);
+    [[nodiscard]] bool is_at_end();
+    [[nodiscard]] Token make_token(TokenType type);
+    [[nodiscard]] Token make_error_token(std::string_view message) const;
     [[nodiscard]] Token make_string();
+    void skip_digits();
     [[nodiscard]] Token make_number();
+    [[nodiscard]] Token make_input();
     [[nodiscard]] Token make_identifier();
     char advance();
     [[nodiscard]] bool match(char expected);
     void skip_whitespace();
-    [[nodiscard]] char peek() const;
-    [[nodiscard]] char peek_next() const;
-    [[nodiscard]] TokenType check_keyword(int start, int length, std::string_view rest, TokenType type) const;
+    [[nodiscard]] char peek();
+    [[nodiscard]] char peek_next();
     [[nodiscard]] TokenType identifier_type();
 
 public:
-    explicit Scanner(const std::string &source) {
-        mSource = source;
-        mStart = mSource.begin();
-        mCurrent = mSource.begin();
+    static constexpr size_t STREAM_BLOCK_SIZE = 64 * 1024;
+
+    explicit Scanner(const std::string_view source) {
+        mStart = source.data();
+        mCurrent = source.data();
+        mEnd = source.data() + source.size();
+        mLine = 1;
+    }
+    explicit Scanner(std::istream &stream) {
+        mpStream = &stream;
+        mStart = nullptr;
+        mCurrent = nullptr;
+        mEnd = nullptr;
         mLine = 1;
     }
     ~Scanner() = default;
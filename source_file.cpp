@@ -0,0 +1,48 @@
+﻿#include "source_file.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+SourceFile::~SourceFile() {
+    if (mpMapping != nullptr)
+        munmap(mpMapping, mSize);
+}
+
+SourceFile::OpenResult SourceFile::open(const char* path) {
+    const int fd = ::open(path, O_RDONLY);
+    if (fd < 0) return OpenResult::FAILED;
+
+    struct stat info{};
+    if (fstat(fd, &info) != 0) {
+        close(fd);
+        return OpenResult::FAILED;
+    }
+    if (!S_ISREG(info.st_mode)) {
+        close(fd);
+        return OpenResult::NOT_REGULAR;
+    }
+
+    mSize = static_cast<size_t>(info.st_size);
+    if (mSize == 0) { // nothing to map; text() is simply empty
+        close(fd);
+        return OpenResult::MAPPED;
+    }
+
+    mpMapping = mmap(nullptr, mSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mpMapping == MAP_FAILED) {
+        mpMapping = nullptr;
+        return OpenResult::FAILED;
+    }
+
+    // the scanner walks the text front to back exactly once
+    madvise(mpMapping, mSize, MADV_SEQUENTIAL);
+    return OpenResult::MAPPED;
+}
+
+std::string_view SourceFile::text() const {
+    if (mpMapping == nullptr) return {};
+    return {static_cast<const char*>(mpMapping), mSize};
+}
@@ -0,0 +1,26 @@
+﻿#pragma once
+
+#include "common.h"
+
+// A script mapped read-only, so its text goes to the scanner without being
+// copied. Only regular files can be mapped; anything else (pipes, ttys,
+// devices) has to be streamed instead.
+class SourceFile {
+    void* mpMapping = nullptr;
+    size_t mSize = 0;
+
+public:
+    SourceFile() = default;
+    SourceFile(const SourceFile &) = delete;
+    SourceFile &operator=(const SourceFile &) = delete;
+    ~SourceFile();
+
+    enum class OpenResult : uint8_t {
+        MAPPED,
+        NOT_REGULAR,
+        FAILED,
+    };
+
+    [[nodiscard]] OpenResult open(const char* path);
+    [[nodiscard]] std::string_view text() const;
+};
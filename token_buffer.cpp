@@ -0,0 +1,79 @@
+﻿#include "token_buffer.h"
+
+#include <limits>
+
+bool TokenBuffer::fits(const std::string_view source) {
+    return source.size() < std::numeric_limits<uint32_t>::max();
+}
+
+// Every token but END_OF_FILE consumes at least one character, so there are
+// at most size + 1 tokens and the block table never has to grow.
+TokenBuffer::TokenBuffer(const std::string_view source, std::pmr::memory_resource* resource)
+    : mSource(source), mScanner(source),
+      mBackground(source.size() >= BACKGROUND_SCAN_MIN_SOURCE && std::thread::hardware_concurrency() > 1),
+      mpResource(mBackground ? std::pmr::new_delete_resource() : resource),
+      mBlocks(source.size() / BLOCK_SIZE + 1, nullptr, mpResource), mMessages(mpResource) {
+    if (mBackground)
+        mScanThread = std::jthread([this](const std::stop_token &stop) {
+            while (!stop.stop_requested() && scan_block()) {}
+        });
+}
+
+TokenBuffer::~TokenBuffer() {
+    if (mScanThread.joinable()) {
+        mScanThread.request_stop();
+        mScanThread.join();
+    }
+    for (Block* block : mBlocks)
+        if (block != nullptr) mpResource->deallocate(block, sizeof(Block), alignof(Block));
+}
+
+// Fills the next block and publishes it. Returns false once END_OF_FILE has
+// been stored.
+bool TokenBuffer::scan_block() {
+    // Block is plain arrays, so raw storage needs no constructor
+    auto* block = static_cast<Block*>(mpResource->allocate(sizeof(Block), alignof(Block)));
+    mBlocks[mScanned / BLOCK_SIZE] = block;
+    bool complete = false;
+
+    for (size_t slot = 0; slot < BLOCK_SIZE && !complete; ++slot) {
+        const Token token = mScanner.scan_token();
+        block->types[slot] = token.type;
+        block->lines[slot] = token.line;
+        block->lengths[slot] = static_cast<uint32_t>(token.lexeme.size());
+        if (token.type == TokenType::ERROR) {
+            std::lock_guard lock(mMessagesMutex);
+            block->offsets[slot] = static_cast<uint32_t>(mMessages.size());
+            mMessages.push_back(token.lexeme);
+        }
+        else
+            block->offsets[slot] = static_cast<uint32_t>(token.lexeme.data() - mSource.data());
+
+        ++mScanned;
+        complete = token.type == TokenType::END_OF_FILE;
+    }
+
+    mPublished.store(mScanned << 1 | (complete ? 1 : 0), std::memory_order_release);
+    if (mBackground) mPublished.notify_all();
+    return !complete;
+}
+
+// Returns index once the token there is published, or the index of
+// END_OF_FILE if the source ends before it.
+size_t TokenBuffer::wait_for(const size_t index) {
+    size_t published = mPublished.load(std::memory_order_acquire);
+    while (index >= published >> 1) {
+        if (published & 1) return (published >> 1) - 1;
+        if (mBackground)
+            mPublished.wait(published, std::memory_order_acquire);
+        else
+            (void) scan_block();
+        published = mPublished.load(std::memory_order_acquire);
+    }
+    return index;
+}
+
+Token TokenBuffer::error_token(const uint32_t message, const int line) const {
+    std::lock_guard lock(mMessagesMutex);
+    return {TokenType::ERROR, mMessages[message], line};
+}
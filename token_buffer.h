@@ -0,0 +1,75 @@
+﻿#pragma once
+
+#include <array>
+#include <atomic>
+#include <memory_resource>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "common.h"
+#include "scanner.h"
+
+// Every token of an in-memory source, scanned in one pass and kept as
+// structure-of-arrays blocks (types, offsets, lengths, lines) that the parser
+// walks by index. Blocks are filled in one tight scanning loop each. Large
+// sources are scanned on a background thread that runs ahead of the parser;
+// otherwise the next block is filled when the parser reaches it, which keeps
+// the lexemes it reads next still in cache.
+class TokenBuffer {
+public:
+    static constexpr size_t BLOCK_SIZE = 1024;
+    static constexpr size_t BACKGROUND_SCAN_MIN_SOURCE = 256 * 1024;
+
+private:
+    // offset doubles as an index into mMessages for ERROR tokens, whose
+    // lexeme is a scanner message rather than a slice of the source
+    struct Block {
+        std::array<TokenType, BLOCK_SIZE> types;
+        std::array<uint32_t, BLOCK_SIZE> offsets;
+        std::array<uint32_t, BLOCK_SIZE> lengths;
+        std::array<int, BLOCK_SIZE> lines;
+    };
+
+    std::string_view mSource;
+    Scanner mScanner; // owned by whoever fills blocks
+    size_t mScanned = 0;
+    bool mBackground = false;
+    std::pmr::memory_resource* mpResource; // blocks and messages
+    std::pmr::vector<Block*> mBlocks; // one slot per possible block, sized up front
+    std::pmr::vector<std::string_view> mMessages;
+    mutable std::mutex mMessagesMutex;
+    // published token count << 1, low bit set once the scan is complete;
+    // tokens below the count are final
+    std::atomic<size_t> mPublished{0};
+    std::jthread mScanThread;
+
+    [[nodiscard]] bool scan_block();
+    [[nodiscard]] size_t wait_for(size_t index);
+    [[nodiscard]] Token error_token(uint32_t message, int line) const;
+
+public:
+    // Sources of 4 GiB or more do not fit the 32-bit offsets; check fits().
+    // Blocks come from resource, except that a background scan allocates
+    // from the heap, as it runs beside a parser using the same resource.
+    TokenBuffer(std::string_view source, std::pmr::memory_resource* resource);
+    ~TokenBuffer();
+    TokenBuffer(const TokenBuffer &) = delete;
+    TokenBuffer &operator=(const TokenBuffer &) = delete;
+
+    [[nodiscard]] static bool fits(std::string_view source);
+
+    // Token at index, scanning or waiting for the background scan if needed.
+    // Past the end it keeps returning END_OF_FILE, as Scanner::scan_token does.
+    [[nodiscard]] Token at(size_t index) {
+        if (index >= mPublished.load(std::memory_order_acquire) >> 1) [[unlikely]]
+            index = wait_for(index);
+
+        const Block &block = *mBlocks[index / BLOCK_SIZE];
+        const size_t slot = index % BLOCK_SIZE;
+        const TokenType type = block.types[slot];
+        if (type == TokenType::ERROR) [[unlikely]]
+            return error_token(block.offsets[slot], block.lines[slot]);
+        return {type, {mSource.data() + block.offsets[slot], block.lengths[slot]}, block.lines[slot]};
+    }
+};
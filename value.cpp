@@ -6,6 +6,10 @@ void ValueArray::write(const Value value) {
     values.push_back(value);
 }
 
+void ValueArray::truncate(const size_t count) {
+    values.resize(count);
+}
+
 size_t ValueArray::count() const {
     return values.size();
 }
@@ -14,10 +18,21 @@ Value ValueArray::get_value_at(const int offset) const {
     return values[offset];
 }
 
+const Value* ValueArray::data() const {
+    return values.data();
+}
+
 void ValueArray::print_value(const int offset) const {
-    std::printf("%g", values[offset]);
+    ::print_value(values[offset]);
 }
 
-void print_value(const Value value) {
-    std::printf("%g", value);
+void print_value(const Value value, FILE* out) {
+    if (value.is_number())
+        std::fprintf(out, "%g", value.as_number());
+    else if (value.is_bool())
+        std::fputs(value.as_bool() ? "true" : "false", out);
+    else if (value.is_nix())
+        std::fputs("nix", out);
+    else
+        std::fputs("<object>", out);
 }
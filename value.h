@@ -1,10 +1,63 @@
 ﻿#pragma once
 
+#include <bit>
+#include <cstdio>
 #include <vector>
 
 #include "common.h"
 
-typedef double Value;
+// NaN boxing: a number is stored as its own double bits. Every other type
+// lives in the payload of a quiet NaN with bit 50 set (QNAN). IEEE arithmetic
+// on numbers never sets that bit in a NaN it produces, so number() is a plain
+// bit cast; doubles from outside the VM go through checked_number() instead:
+//   nix / false / true   QNAN | tag (1, 2, 3)
+//   objects (reserved)   SIGN_BIT | QNAN | pointer
+// so a Value stays 8 bytes and number accesses are plain bit casts.
+class Value {
+    static constexpr uint64_t SIGN_BIT = 0x8000000000000000;
+    static constexpr uint64_t QNAN = 0x7ffc000000000000;
+    static constexpr uint64_t TAG_NIX = 1;
+    static constexpr uint64_t TAG_FALSE = 2;
+    static constexpr uint64_t TAG_TRUE = 3;
+    static constexpr uint64_t CANONICAL_NAN = 0x7ff8000000000000;
+
+    uint64_t bits;
+
+    constexpr explicit Value(const uint64_t raw) : bits(raw) {}
+
+public:
+    Value() = default;
+
+    [[nodiscard]] static constexpr Value number(const double number) { return Value(std::bit_cast<uint64_t>(number)); }
+    // For doubles from outside the VM, such as inputs: drops any NaN payload,
+    // keeping the sign, so the value cannot alias a tag.
+    [[nodiscard]] static constexpr Value checked_number(const double number) {
+        const uint64_t bits = std::bit_cast<uint64_t>(number);
+        return Value(number != number ? (bits & SIGN_BIT) | CANONICAL_NAN : bits);
+    }
+    [[nodiscard]] static constexpr Value nix() { return Value(QNAN | TAG_NIX); }
+    [[nodiscard]] static constexpr Value boolean(const bool boolean) { return Value(QNAN | (boolean ? TAG_TRUE : TAG_FALSE)); }
+    [[nodiscard]] static constexpr Value from_bits(const uint64_t raw) { return Value(raw); }
+
+    [[nodiscard]] constexpr bool is_number() const { return (bits & QNAN) != QNAN; }
+    [[nodiscard]] constexpr bool is_nix() const { return bits == (QNAN | TAG_NIX); }
+    [[nodiscard]] constexpr bool is_bool() const { return (bits | 1) == (QNAN | TAG_TRUE); }
+    [[nodiscard]] constexpr bool is_object() const { return (bits & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT); }
+
+    [[nodiscard]] constexpr double as_number() const { return std::bit_cast<double>(bits); }
+    [[nodiscard]] constexpr bool as_bool() const { return bits == (QNAN | TAG_TRUE); }
+    [[nodiscard]] constexpr uint64_t raw_bits() const { return bits; }
+};
+
+static_assert(sizeof(Value) == sizeof(double));
+
+// Whether two runs produced the same result, bit for bit. IEEE 754 leaves
+// open which NaN an operation on two NaNs returns, and compilers swap the
+// operands of + and *, so any NaN matches any other.
+[[nodiscard]] constexpr bool same_result(const Value a, const Value b) {
+    const auto isNan = [](const Value value) { return value.is_number() && value.as_number() != value.as_number(); };
+    return a.raw_bits() == b.raw_bits() || (isNan(a) && isNan(b));
+}
 
 class ValueArray {
     std::vector<Value> values;
@@ -16,9 +69,11 @@ public:
     }
 
     void write(Value value);
+    void truncate(size_t count);
     void print_value(int offset) const;
     [[nodiscard]] size_t count() const;
     [[nodiscard]] Value get_value_at(int offset) const;
+    [[nodiscard]] const Value* data() const;
 };
 
-void print_value(Value value);
\ No newline at end of file
+void print_value(Value value, FILE* out = stdout);
\ No newline at end of file
@@ -1,88 +1,702 @@
 ﻿#include "vm.h"
 
+#include <algorithm>
+
+#include "column_kernels.h"
+#include "optimizer.h"
+
+// Instrumentation hooks for the run loops. Each is an `if constexpr` on the
+// loop's FEATURES, so a specialization without the feature has no trace of it.
+#define TRACE_EXECUTION() \
+    do { \
+        if constexpr ((FEATURES & RUN_TRACE) != 0) trace_execution(stackTop); \
+    } while (false)
+#define PROFILE_INSTRUCTION() \
+    do { \
+        if constexpr ((FEATURES & RUN_PROFILE) != 0) mProfiler.record(*ip); \
+    } while (false)
+#define SAMPLE_INSTRUCTION() \
+    do { \
+        if constexpr ((FEATURES & RUN_SAMPLE) != 0) mSampler.mIp.store(ip, std::memory_order_relaxed); \
+    } while (false)
+
+void VM::trace_execution(const Value* stackTop) const {
+    std::fprintf(mpErrorStream, "          ");
+    for (const Value* slot = mValueStack.data(); slot < stackTop; ++slot) {
+        std::fprintf(mpErrorStream, "[ ");
+        print_value(*slot, mpErrorStream);
+        std::fprintf(mpErrorStream, " ]");
+    }
+    std::fprintf(mpErrorStream, "\n");
+    disassemble_instruction(mChunk, static_cast<int>(ip - mChunk.code), mpErrorStream);
+}
+
+bool VM::runtime_error(const char* message) const {
+    const int line = find_line(mChunk.lines, mChunk.lineCount, static_cast<int>(ip - mChunk.code));
+    std::fprintf(mpErrorStream, "%s\n[line %d] in script\n", message, line);
+    return false;
+}
+
+// Validates the stack instruction at ip before it runs: a known opcode whose
+// operands fit in the chunk, in-range constant and input indices, enough
+// values on the stack and room for its result, and number operands.
+bool VM::check_instruction(const Value* stackTop) const {
+    const auto offset = static_cast<size_t>(ip - mChunk.code);
+    if (offset >= mChunk.codeSize) return runtime_error("Ran past the end of the chunk.");
+    if (*ip > static_cast<uint8_t>(OpCode::INPUT)) return runtime_error("Unknown opcode.");
+
+    const auto op = static_cast<OpCode>(*ip);
+    if (offset + instruction_size(op) > mChunk.codeSize) return runtime_error("Truncated instruction.");
+
+    int operands = 1;
+    const Value* constant = nullptr;
+    switch (op) {
+        case OpCode::CONSTANT:
+        case OpCode::CONSTANT_LONG: {
+            const size_t index = op == OpCode::CONSTANT ? ip[1] : ip[1] | ip[2] << 8 | ip[3] << 16;
+            if (index >= mChunk.constantCount) return runtime_error("Constant index out of range.");
+            operands = 0;
+            break;
+        }
+        case OpCode::INPUT:
+            if (ip[1] >= mInputs.size()) return runtime_error("Input index out of range.");
+            operands = 0;
+            break;
+        case OpCode::ADD:
+        case OpCode::SUBTRACT:
+        case OpCode::MULTIPLY:
+        case OpCode::DIVIDE:
+            operands = 2;
+            break;
+        case OpCode::ADD_CONSTANT:
+        case OpCode::SUBTRACT_CONSTANT:
+        case OpCode::MULTIPLY_CONSTANT:
+        case OpCode::DIVIDE_CONSTANT:
+            if (ip[1] >= mChunk.constantCount) return runtime_error("Constant index out of range.");
+            constant = &mChunk.constants[ip[1]];
+            break;
+        case OpCode::NEGATE:
+        case OpCode::RETURN:
+            break;
+    }
+
+    const auto depth = static_cast<int>(stackTop - mValueStack.data());
+    if (depth < operands) return runtime_error("Stack underflow.");
+    if (depth + stack_effect(op) > mChunk.maxStackDepth) return runtime_error("Stack overflow.");
+    if (op == OpCode::RETURN) return true;
+    for (int i = 1; i <= operands; ++i) {
+        if (!stackTop[-i].is_number()) return runtime_error("Operands must be numbers.");
+    }
+    if (constant != nullptr && !constant->is_number()) return runtime_error("Operands must be numbers.");
+    return true;
+}
+
+// The register-format counterpart: every register operand within the
+// register file, constant and input indices in range, number sources.
+bool VM::check_register_instruction() const {
+    const auto offset = static_cast<size_t>(ip - mChunk.code);
+    if (offset >= mChunk.codeSize) return runtime_error("Ran past the end of the chunk.");
+    if (*ip > static_cast<uint8_t>(RegOpCode::LOADI)) return runtime_error("Unknown opcode.");
+
+    const auto op = static_cast<RegOpCode>(*ip);
+    if (offset + register_instruction_size(op) > mChunk.codeSize) return runtime_error("Truncated instruction.");
+
+    const auto registerCount = static_cast<size_t>(mChunk.maxStackDepth);
+    const Value* registers = mValueStack.data();
+    const auto source = [&](const uint8_t operand, const bool isConstant) -> const Value* {
+        if (isConstant) return operand < mChunk.constantCount ? &mChunk.constants[operand] : nullptr;
+        return operand < registerCount ? &registers[operand] : nullptr;
+    };
+
+    if (op != RegOpCode::RETURN && ip[1] >= registerCount) return runtime_error("Register out of range.");
+    switch (op) {
+        case RegOpCode::LOADK:
+            if (ip[2] >= mChunk.constantCount) return runtime_error("Constant index out of range.");
+            return true;
+        case RegOpCode::LOADK_LONG:
+            if ((ip[2] | ip[3] << 8 | ip[4] << 16) >= static_cast<int>(mChunk.constantCount))
+                return runtime_error("Constant index out of range.");
+            return true;
+        case RegOpCode::LOADI:
+            if (ip[2] >= mInputs.size()) return runtime_error("Input index out of range.");
+            return true;
+        case RegOpCode::RETURN:
+            if (ip[1] >= registerCount) return runtime_error("Register out of range.");
+            return true;
+        case RegOpCode::NEGATE: {
+            const Value* value = source(ip[2], false);
+            if (value == nullptr) return runtime_error("Register out of range.");
+            if (!value->is_number()) return runtime_error("Operand must be a number.");
+            return true;
+        }
+        default: {
+            // _RR, _RK and _KR repeat in that order from ADD_RR
+            const int form = (static_cast<int>(op) - static_cast<int>(RegOpCode::ADD_RR)) % 3;
+            const Value* left = source(ip[2], form == 2);
+            const Value* right = source(ip[3], form == 1);
+            if (left == nullptr || right == nullptr) return runtime_error("Operand index out of range.");
+            if (!left->is_number() || !right->is_number()) return runtime_error("Operands must be numbers.");
+            return true;
+        }
+    }
+}
+
+#define CHECK_INSTRUCTION(check) \
+    do { \
+        if constexpr ((FEATURES & RUN_CHECKS) != 0) { \
+            if (!(check)) return InterpretResult::INTERPRET_RUNTIME_ERROR; \
+        } \
+    } while (false)
+
 InterpretResult VM::run() {
+    static constexpr InterpretResult (VM::*LOOPS[])() = {
+        &VM::run_loop<0>, &VM::run_loop<1>, &VM::run_loop<2>, &VM::run_loop<3>,
+        &VM::run_loop<4>, &VM::run_loop<5>, &VM::run_loop<6>, &VM::run_loop<7>,
+        &VM::run_loop<8>, &VM::run_loop<9>, &VM::run_loop<10>, &VM::run_loop<11>,
+        &VM::run_loop<12>, &VM::run_loop<13>, &VM::run_loop<14>, &VM::run_loop<15>,
+    };
+    static_assert(std::size(LOOPS) == RUN_VARIANTS, "one loop per feature combination");
+    return (this->*LOOPS[run_features()])();
+}
+
+InterpretResult VM::run_registers() {
+    static constexpr InterpretResult (VM::*LOOPS[])() = {
+        &VM::run_registers_loop<0>, &VM::run_registers_loop<1>, &VM::run_registers_loop<2>,
+        &VM::run_registers_loop<3>, &VM::run_registers_loop<4>, &VM::run_registers_loop<5>,
+        &VM::run_registers_loop<6>, &VM::run_registers_loop<7>, &VM::run_registers_loop<8>,
+        &VM::run_registers_loop<9>, &VM::run_registers_loop<10>, &VM::run_registers_loop<11>,
+        &VM::run_registers_loop<12>, &VM::run_registers_loop<13>, &VM::run_registers_loop<14>,
+        &VM::run_registers_loop<15>,
+    };
+    static_assert(std::size(LOOPS) == RUN_VARIANTS, "one loop per feature combination");
+    return (this->*LOOPS[run_features()])();
+}
+
+uint8_t VM::run_features() const {
+    return (mTrace ? RUN_TRACE : 0) | (mProfile ? RUN_PROFILE : 0) | (mChecks ? RUN_CHECKS : 0) |
+           (mSample ? RUN_SAMPLE : 0);
+}
+
+template <uint8_t FEATURES>
+InterpretResult VM::run_loop() {
+    // The stack top lives in a local for the whole loop so it can stay in a
+    // register; the compiler sized the stack, so pushes and pops are unchecked.
+    Value* stackTop = mpStackTop;
+    const Value* constants = mChunk.constants;
+    const Value* inputs = mInputs.data();
+
 #define READ_BYTE() (*ip++)
-#define READ_CONSTANT() (mpChunk->get_constant_at(READ_BYTE()))
+#define READ_CONSTANT() (constants[READ_BYTE()])
+#define READ_CONSTANT_LONG() \
+    (ip += 3, constants[ip[-3] | (ip[-2] << 8) | (ip[-1] << 16)])
+#define PUSH(value) (*stackTop++ = (value))
+#define POP() (*--stackTop)
 #define BINARY_OP(op) \
     do { \
-        Value b = pop(); \
-        Value a = pop(); \
-        push(a op b); \
+        const double b = POP().as_number(); \
+        stackTop[-1] = Value::number(stackTop[-1].as_number() op b); \
     } while (false)
+#define CONSTANT_OP(op) \
+    do { \
+        const double b = READ_CONSTANT().as_number(); \
+        stackTop[-1] = Value::number(stackTop[-1].as_number() op b); \
+    } while (false)
+
+// With COMPUTED_GOTO every handler ends in its own indirect jump through the
+// dispatch table, so the branch predictor can learn per-opcode successors.
+// Otherwise we fall back to the portable switch inside a loop.
+#ifdef COMPUTED_GOTO
+    static void* dispatchTable[] = {
+        &&op_CONSTANT,
+        &&op_ADD,
+        &&op_SUBTRACT,
+        &&op_MULTIPLY,
+        &&op_DIVIDE,
+        &&op_NEGATE,
+        &&op_RETURN,
+        &&op_ADD_CONSTANT,
+        &&op_SUBTRACT_CONSTANT,
+        &&op_MULTIPLY_CONSTANT,
+        &&op_DIVIDE_CONSTANT,
+        &&op_CONSTANT_LONG,
+        &&op_INPUT,
+    };
+    static_assert(std::size(dispatchTable) == static_cast<size_t>(OpCode::INPUT) + 1,
+                  "dispatch table out of sync with OpCode");
+
+#define CASE(name) op_##name
+#define DISPATCH() \
+    do { \
+        TRACE_EXECUTION(); \
+        CHECK_INSTRUCTION(check_instruction(stackTop)); \
+        PROFILE_INSTRUCTION(); \
+        SAMPLE_INSTRUCTION(); \
+        goto *dispatchTable[READ_BYTE()]; \
+    } while (false)
+
+    DISPATCH();
+#else
+#define CASE(name) case static_cast<uint8_t>(OpCode::name)
+#define DISPATCH() break
 
     for (;;) {
-        #ifdef DEBUG
-        std::printf("          ");
-        for (const auto value: mValueStack) {
-            std::printf("[ ");
-            print_value(value);
-            std::printf(" ]");
-        }
-        std::printf("\n");
-        // mpChunk->disassemble_instruction(((int)(ip - mpChunk->get_code())));
-        #endif
+        TRACE_EXECUTION();
+        CHECK_INSTRUCTION(check_instruction(stackTop));
+        PROFILE_INSTRUCTION();
+        SAMPLE_INSTRUCTION();
 
-        uint8_t instruction;
-        switch (instruction = READ_BYTE()) {
-            case static_cast<uint8_t>(OpCode::CONSTANT): {
+        switch (READ_BYTE()) {
+#endif
+            CASE(CONSTANT): {
                 const Value constant = READ_CONSTANT();
-                push(constant);
-                break;
+                PUSH(constant);
+                DISPATCH();
             }
-            case static_cast<uint8_t>(OpCode::ADD): {
+            CASE(ADD): {
                 BINARY_OP(+);
-                break;
+                DISPATCH();
             }
-            case static_cast<uint8_t>(OpCode::SUBTRACT): {
+            CASE(SUBTRACT): {
                 BINARY_OP(-);
-                break;
+                DISPATCH();
             }
-            case static_cast<uint8_t>(OpCode::MULTIPLY): {
+            CASE(MULTIPLY): {
                 BINARY_OP(*);
-                break;
+                DISPATCH();
             }
-            case static_cast<uint8_t>(OpCode::DIVIDE): {
+            CASE(DIVIDE): {
                 BINARY_OP(/);
-                break;
+                DISPATCH();
             }
-            case static_cast<uint8_t>(OpCode::NEGATE): {
-                push(-pop());
-                break;
+            CASE(NEGATE): {
+                stackTop[-1] = Value::number(-stackTop[-1].as_number());
+                DISPATCH();
             }
-            case static_cast<uint8_t>(OpCode::RETURN): {
-                print_value(pop());
-                std::printf("\n");
+            CASE(RETURN): {
+                mResult = POP();
+                if (mPrintResult) {
+                    print_value(mResult);
+                    std::printf("\n");
+                }
+                mpStackTop = stackTop;
                 return InterpretResult::INTERPRET_OK;
             }
+            CASE(ADD_CONSTANT): {
+                CONSTANT_OP(+);
+                DISPATCH();
+            }
+            CASE(SUBTRACT_CONSTANT): {
+                CONSTANT_OP(-);
+                DISPATCH();
+            }
+            CASE(MULTIPLY_CONSTANT): {
+                CONSTANT_OP(*);
+                DISPATCH();
+            }
+            CASE(DIVIDE_CONSTANT): {
+                CONSTANT_OP(/);
+                DISPATCH();
+            }
+            CASE(CONSTANT_LONG): {
+                const Value constant = READ_CONSTANT_LONG();
+                PUSH(constant);
+                DISPATCH();
+            }
+            CASE(INPUT): {
+                const Value input = inputs[READ_BYTE()];
+                PUSH(input);
+                DISPATCH();
+            }
+#ifndef COMPUTED_GOTO
         }
     }
+#endif
 
+#undef DISPATCH
+#undef CASE
+#undef CONSTANT_OP
 #undef BINARY_OP
+#undef POP
+#undef PUSH
+#undef READ_CONSTANT_LONG
 #undef READ_CONSTANT
 #undef READ_BYTE
 }
 
-InterpretResult VM::interpret(std::string &source) {
-    Chunk chunk = Chunk();
+template <uint8_t FEATURES>
+InterpretResult VM::run_registers_loop() {
+    Value* registers = mValueStack.data();
+    [[maybe_unused]] Value* stackTop = registers + mChunk.maxStackDepth; // traced as the register file
+    const Value* constants = mChunk.constants;
+    const Value* inputs = mInputs.data();
 
-    if (!parser.compile(source, &chunk)) {
-        return InterpretResult::INTERPRET_COMPILE_ERROR;
+#define READ_BYTE() (*ip++)
+#define READ_CONSTANT() (constants[READ_BYTE()])
+#define REGISTER_OP(op, left, right) \
+    do { \
+        Value* dst = &registers[READ_BYTE()]; \
+        const double a = (left).as_number(); \
+        const double b = (right).as_number(); \
+        *dst = Value::number(a op b); \
+    } while (false)
+#define ARITHMETIC(name, op) \
+    CASE(name##_RR): { \
+        REGISTER_OP(op, registers[READ_BYTE()], registers[READ_BYTE()]); \
+        DISPATCH(); \
+    } \
+    CASE(name##_RK): { \
+        REGISTER_OP(op, registers[READ_BYTE()], READ_CONSTANT()); \
+        DISPATCH(); \
+    } \
+    CASE(name##_KR): { \
+        REGISTER_OP(op, READ_CONSTANT(), registers[READ_BYTE()]); \
+        DISPATCH(); \
     }
 
-    mpChunk = &chunk;
-    ip = mpChunk->get_code();
+#ifdef COMPUTED_GOTO
+    static void* dispatchTable[] = {
+        &&op_LOADK, &&op_LOADK_LONG,
+        &&op_ADD_RR, &&op_ADD_RK, &&op_ADD_KR,
+        &&op_SUBTRACT_RR, &&op_SUBTRACT_RK, &&op_SUBTRACT_KR,
+        &&op_MULTIPLY_RR, &&op_MULTIPLY_RK, &&op_MULTIPLY_KR,
+        &&op_DIVIDE_RR, &&op_DIVIDE_RK, &&op_DIVIDE_KR,
+        &&op_NEGATE,
+        &&op_RETURN,
+        &&op_LOADI,
+    };
+    static_assert(std::size(dispatchTable) == static_cast<size_t>(RegOpCode::LOADI) + 1,
+                  "dispatch table out of sync with RegOpCode");
 
-    const InterpretResult result = run();
+#define CASE(name) op_##name
+#define DISPATCH() \
+    do { \
+        TRACE_EXECUTION(); \
+        CHECK_INSTRUCTION(check_register_instruction()); \
+        PROFILE_INSTRUCTION(); \
+        SAMPLE_INSTRUCTION(); \
+        goto *dispatchTable[READ_BYTE()]; \
+    } while (false)
+
+    DISPATCH();
+#else
+#define CASE(name) case static_cast<uint8_t>(RegOpCode::name)
+#define DISPATCH() break
+
+    for (;;) {
+        TRACE_EXECUTION();
+        CHECK_INSTRUCTION(check_register_instruction());
+        PROFILE_INSTRUCTION();
+        SAMPLE_INSTRUCTION();
+
+        switch (READ_BYTE()) {
+#endif
+            CASE(LOADK): {
+                Value* dst = &registers[READ_BYTE()];
+                *dst = READ_CONSTANT();
+                DISPATCH();
+            }
+            CASE(LOADK_LONG): {
+                Value* dst = &registers[READ_BYTE()];
+                ip += 3;
+                *dst = constants[ip[-3] | (ip[-2] << 8) | (ip[-1] << 16)];
+                DISPATCH();
+            }
+            ARITHMETIC(ADD, +)
+            ARITHMETIC(SUBTRACT, -)
+            ARITHMETIC(MULTIPLY, *)
+            ARITHMETIC(DIVIDE, /)
+            CASE(NEGATE): {
+                Value* dst = &registers[READ_BYTE()];
+                *dst = Value::number(-registers[READ_BYTE()].as_number());
+                DISPATCH();
+            }
+            CASE(RETURN): {
+                mResult = registers[READ_BYTE()];
+                if (mPrintResult) {
+                    print_value(mResult);
+                    std::printf("\n");
+                }
+                return InterpretResult::INTERPRET_OK;
+            }
+            CASE(LOADI): {
+                Value* dst = &registers[READ_BYTE()];
+                *dst = inputs[READ_BYTE()];
+                DISPATCH();
+            }
+#ifndef COMPUTED_GOTO
+        }
+    }
+#endif
 
+#undef DISPATCH
+#undef CASE
+#undef ARITHMETIC
+#undef REGISTER_OP
+#undef READ_CONSTANT
+#undef READ_BYTE
+}
+
+#undef CHECK_INSTRUCTION
+#undef SAMPLE_INSTRUCTION
+#undef PROFILE_INSTRUCTION
+#undef TRACE_EXECUTION
+
+void VM::optimize(Chunk *chunk) {
+    if (mPeephole && chunk->get_format() == ChunkFormat::STACK) {
+        const int removed = peephole_optimize(chunk, mParser.arena());
+        std::fprintf(mpErrorStream, "[peephole] removed %d instructions\n", removed);
+#ifdef DEBUG
+        chunk->disassemble("optimized");
+#endif
+    }
+}
+
+bool VM::compile(const std::string_view source, Chunk *chunk) {
+    if (!mParser.compile(source, chunk)) {
+        return false;
+    }
+
+    optimize(chunk);
+    return true;
+}
+
+bool VM::compile(std::istream &stream, Chunk *chunk) {
+    if (!mParser.compile(stream, chunk)) {
+        return false;
+    }
+
+    optimize(chunk);
+    return true;
+}
+
+uint8_t VM::compile_options() const {
+    return (mParser.mFoldConstants ? 1 : 0) | (mPeephole ? 2 : 0) | (mParser.mRegisterMode ? 4 : 0);
+}
+
+CompiledScript VM::prepare(const std::string_view source) {
+    const uint8_t options = compile_options();
+    if (CompiledScript cached = mChunkCache.find(source, options))
+        return cached;
+    return compile_cached(source, options);
+}
+
+CompiledScript VM::compile_cached(const std::string_view source, const uint8_t options) {
+    auto chunk = std::make_shared<Chunk>();
+    if (!compile(source, chunk.get()))
+        return nullptr;
+
+    mChunkCache.insert(source, options, chunk);
+    return chunk;
+}
+
+// Runs mChunk as native code, which the caller has just compiled into
+// mJitCode. In verify mode the interpreter runs it too and any difference in
+// the result bits is a runtime error.
+InterpretResult VM::run_jit() {
+    const Value result = mJitCode.run(mChunk.constants, mInputs.data());
+
+    if (mJitVerify) {
+        const bool printResult = mPrintResult;
+        mPrintResult = false;
+        const InterpretResult status = run_chunk();
+        mPrintResult = printResult;
+        if (status != InterpretResult::INTERPRET_OK || !same_result(mResult, result)) {
+            std::fprintf(mpErrorStream, "[jit] result 0x%016llx differs from the interpreter's 0x%016llx\n",
+                         static_cast<unsigned long long>(result.raw_bits()),
+                         static_cast<unsigned long long>(mResult.raw_bits()));
+            return InterpretResult::INTERPRET_RUNTIME_ERROR;
+        }
+    }
+
+    mResult = result;
+    if (mPrintResult) {
+        print_value(mResult);
+        std::printf("\n");
+    }
+    return InterpretResult::INTERPRET_OK;
+}
+
+// Inputs are checked once up front, so the handlers index mInputs unchecked.
+bool VM::check_inputs(const ChunkView &chunk, const size_t given) const {
+    if (static_cast<size_t>(chunk.inputCount) <= given) return true;
+
+    std::fprintf(mpErrorStream, "Input $%d is not bound (%zu given).\n", chunk.inputCount - 1, given);
+    return false;
+}
+
+void VM::bind(const ChunkView &chunk) {
+    mChunk = chunk;
+    const auto depth = static_cast<size_t>(mChunk.maxStackDepth);
+    if (mValueStack.size() < depth)
+        mValueStack.resize(depth);
+}
+
+InterpretResult VM::run_chunk() {
+    ip = mChunk.code;
+    mpStackTop = mValueStack.data();
+    return mChunk.format == ChunkFormat::REGISTER ? run_registers() : run();
+}
+
+void VM::begin_instrumentation() {
+    if (mProfile) mProfiler.begin_run(mChunk.format);
+    if (mSample) mSampler.begin_run(mChunk);
+}
+
+void VM::end_instrumentation() {
+    if (mSample) mSampler.end_run();
+    if (mProfile) {
+        mProfiler.end_run();
+        mProfiler.report(mpErrorStream);
+        mProfiler.reset();
+    }
+}
+
+InterpretResult VM::execute(const ChunkView &chunk) {
+    if (!check_inputs(chunk, mInputs.size()))
+        return InterpretResult::INTERPRET_RUNTIME_ERROR;
+
+    bind(chunk);
+    if (mJit && run_features() == 0 && mJitCode.compile(mChunk))
+        return run_jit();
+
+    begin_instrumentation();
+    const InterpretResult result = run_chunk();
+    end_instrumentation();
     return result;
 }
 
+// One pass of mChunk over `rows` rows starting at `first`. Slot n is either
+// its own tile in mColumns or, right after an INPUT, the caller's column, so
+// inputs are never copied.
+void VM::run_columns(const double* const* columns, const size_t first, const size_t rows, double* results) {
+    const ColumnKernels &kernels = column_kernels();
+    const Value* constants = mChunk.constants;
+    const double** slots = mColumnSlots.data();
+    double* tiles = mColumns.data();
+    const auto tile = [tiles](const int slot) { return tiles + slot * BATCH_TILE; };
+
+    int depth = 0;
+    for (const uint8_t* ip = mChunk.code;;) {
+        const auto op = static_cast<OpCode>(*ip);
+        switch (op) {
+            case OpCode::CONSTANT:
+            case OpCode::CONSTANT_LONG: {
+                const size_t index = op == OpCode::CONSTANT ? ip[1] : ip[1] | ip[2] << 8 | ip[3] << 16;
+                kernels.fill(tile(depth), constants[index].as_number(), rows);
+                slots[depth] = tile(depth);
+                ++depth;
+                break;
+            }
+            case OpCode::INPUT:
+                slots[depth++] = columns[ip[1]] + first;
+                break;
+            case OpCode::ADD:
+            case OpCode::SUBTRACT:
+            case OpCode::MULTIPLY:
+            case OpCode::DIVIDE:
+                --depth;
+                kernels.binary[static_cast<int>(op) - static_cast<int>(OpCode::ADD)](
+                    tile(depth - 1), slots[depth - 1], slots[depth], rows);
+                slots[depth - 1] = tile(depth - 1);
+                break;
+            case OpCode::ADD_CONSTANT:
+            case OpCode::SUBTRACT_CONSTANT:
+            case OpCode::MULTIPLY_CONSTANT:
+            case OpCode::DIVIDE_CONSTANT:
+                kernels.binary_constant[static_cast<int>(op) - static_cast<int>(OpCode::ADD_CONSTANT)](
+                    tile(depth - 1), slots[depth - 1], constants[ip[1]].as_number(), rows);
+                slots[depth - 1] = tile(depth - 1);
+                break;
+            case OpCode::NEGATE:
+                kernels.negate(tile(depth - 1), slots[depth - 1], rows);
+                slots[depth - 1] = tile(depth - 1);
+                break;
+            case OpCode::RETURN:
+                std::copy_n(slots[depth - 1], rows, results);
+                return;
+        }
+        ip += instruction_size(op);
+    }
+}
+
+InterpretResult VM::execute_batch(const ChunkView &chunk, const std::span<const double* const> columns,
+                                  const size_t rows, double* results) {
+    if (!check_inputs(chunk, columns.size()))
+        return InterpretResult::INTERPRET_RUNTIME_ERROR;
+
+    // the column kernels carry no instrumentation, so instrumented runs
+    // take the row-by-row path too; the profiler and sampler see the whole
+    // batch as one run
+    if (chunk.format == ChunkFormat::REGISTER || run_features() != 0) {
+        std::vector<Value> row(columns.size());
+        const std::span<const Value> inputs = mInputs;
+        const bool printResult = mPrintResult;
+        mInputs = row;
+        mPrintResult = false;
+        bind(chunk);
+        begin_instrumentation();
+        InterpretResult status = InterpretResult::INTERPRET_OK;
+        for (size_t i = 0; i < rows && status == InterpretResult::INTERPRET_OK; ++i) {
+            for (size_t k = 0; k < columns.size(); ++k)
+                row[k] = Value::checked_number(columns[k][i]);
+            status = run_chunk();
+            if (status == InterpretResult::INTERPRET_OK) results[i] = mResult.as_number();
+        }
+        end_instrumentation();
+        mInputs = inputs;
+        mPrintResult = printResult;
+        return status;
+    }
+
+    mChunk = chunk;
+    const auto depth = static_cast<size_t>(chunk.maxStackDepth);
+    if (mColumns.size() < depth * BATCH_TILE)
+        mColumns.resize(depth * BATCH_TILE);
+    if (mColumnSlots.size() < depth)
+        mColumnSlots.resize(depth);
+
+    for (size_t first = 0; first < rows; first += BATCH_TILE)
+        run_columns(columns.data(), first, std::min(BATCH_TILE, rows - first), results + first);
+    return InterpretResult::INTERPRET_OK;
+}
+
+InterpretResult VM::interpret(const std::string_view source) {
+    // Only a source seen before gets its own cached chunk; a first sighting
+    // compiles into the recycled chunk, so a stream of new lines allocates
+    // nothing in steady state.
+    if (mChunkCache.capacity() > 0) {
+        const uint8_t options = compile_options();
+        CompiledScript script = mChunkCache.find(source, options);
+        if (!script && mChunkCache.missed_before(source, options)) {
+            script = compile_cached(source, options);
+            if (!script) return InterpretResult::INTERPRET_COMPILE_ERROR;
+        }
+        if (script) return execute(script->view());
+    }
+
+    mRecycledChunk.clear();
+
+    if (!compile(source, &mRecycledChunk)) {
+        return InterpretResult::INTERPRET_COMPILE_ERROR;
+    }
+
+    return execute(mRecycledChunk.view());
+}
+
+InterpretResult VM::interpret(std::istream &stream) {
+    mRecycledChunk.clear();
+
+    if (!compile(stream, &mRecycledChunk)) {
+        return InterpretResult::INTERPRET_COMPILE_ERROR;
+    }
+
+    return execute(mRecycledChunk.view());
+}
+
 void VM::push(const Value value) {
-    mValueStack.push_back(value);
+    *mpStackTop++ = value;
 }
 
 Value VM::pop() {
-    const Value value = mValueStack.back();
-    mValueStack.pop_back();
-    return value;
+    return *--mpStackTop;
 }
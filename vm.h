@@ -1,7 +1,13 @@
 ﻿#pragma once
 
+#include <span>
+
 #include "chunk.h"
+#include "chunk_cache.h"
 #include "compiler.h"
+#include "jit.h"
+#include "profiler.h"
+#include "sampler.h"
 
 enum class InterpretResult : uint8_t {
     INTERPRET_OK,
@@ -9,18 +15,103 @@ enum class InterpretResult : uint8_t {
     INTERPRET_RUNTIME_ERROR,
 };
 
+// Instrumentation the run loops are specialized on. Every combination is
+// compiled as its own loop and VM::run picks one from mTrace, mProfile,
+// mChecks and mSample, so the plain loop pays nothing for the features it
+// leaves out.
+constexpr uint8_t RUN_TRACE = 1;   // print the stack and each instruction before it runs
+constexpr uint8_t RUN_PROFILE = 2; // count (and time) instructions in the profiler
+constexpr uint8_t RUN_CHECKS = 4;  // validate each instruction's operands and stack use
+constexpr uint8_t RUN_SAMPLE = 8;  // publish ip to the sampler's signal handler
+constexpr size_t RUN_VARIANTS = 16;
+
+// One interpreter instance: its own parser, value stack and profiler. There is
+// no shared mutable state between instances, so separate VMs may compile and
+// run on separate threads at the same time; a single VM is not thread-safe.
 class VM {
-    Chunk *mpChunk{};
-    uint8_t* ip{};
+    ChunkView mChunk{};
+    const uint8_t* ip{};
+    // sized once per chunk from Chunk::get_max_stack_depth(), never grown mid-run
     std::vector<Value> mValueStack;
+    Value* mpStackTop{};
+    Chunk mRecycledChunk; // compiled into by every interpret() call, keeping its buffers
+    Jit mJitCode;
+    // execute_batch's stack: one tile of BATCH_TILE rows per slot
+    std::vector<double> mColumns;
+    std::vector<const double*> mColumnSlots;
+
+    void optimize(Chunk *chunk);
+    [[nodiscard]] bool check_inputs(const ChunkView &chunk, size_t given) const;
+    void bind(const ChunkView &chunk); // makes chunk current and sizes the stack for it
+    InterpretResult run_chunk(); // runs the bound chunk from its first instruction
+    void begin_instrumentation();
+    void end_instrumentation(); // prints the profile, if one was taken
+    // Compiles source into a new chunk and caches it under options.
+    [[nodiscard]] CompiledScript compile_cached(std::string_view source, uint8_t options);
+    InterpretResult run_jit();
+    void run_columns(const double* const* columns, size_t first, size_t rows, double* results);
+
+    template <uint8_t FEATURES> InterpretResult run_loop();
+    template <uint8_t FEATURES> InterpretResult run_registers_loop();
+    [[nodiscard]] uint8_t run_features() const;
+    void trace_execution(const Value* stackTop) const;
+    // Reports message against the line of the instruction at ip; returns false.
+    bool runtime_error(const char* message) const;
+    [[nodiscard]] bool check_instruction(const Value* stackTop) const;
+    [[nodiscard]] bool check_register_instruction() const;
 public:
+    // Rows execute_batch pushes through each instruction at a time; one
+    // column of every stack slot stays in L1.
+    static constexpr size_t BATCH_TILE = 256;
+
+    Parser mParser; // compile options live on the parser
+    bool mPeephole = false;
+    bool mPrintResult = true; // print each script's result to stdout
+    Value mResult{}; // result of the last successful run
+    std::span<const Value> mInputs; // $0, $1, ... for execute() and interpret()
+    FILE* mpErrorStream = stderr; // runtime errors, optimizer and profiler reports
+#ifdef DEBUG
+    bool mTrace = true; // trace every instruction to mpErrorStream
+#else
+    bool mTrace = false; // trace every instruction to mpErrorStream
+#endif
+    bool mProfile = false;
+    bool mChecks = false; // validate every instruction before it runs
+    bool mSample = false; // let mSampler attribute SIGPROF samples; the timer is started separately
+    bool mJit = false; // only honoured in JIT builds; instrumented runs always interpret
+    bool mJitVerify = false; // also interpret every JIT run and fail on any difference
+    Profiler mProfiler;
+    Sampler mSampler;
+    // consulted by prepare() and interpret(source); off until given a
+    // capacity. interpret() only caches sources it has seen before.
+    ChunkCache mChunkCache;
+
     VM() = default;
     ~VM() = default;
 
-    InterpretResult interpret(std::string &source);
+    [[nodiscard]] bool compile(std::string_view source, Chunk *chunk);
+    [[nodiscard]] bool compile(std::istream &stream, Chunk *chunk);
+    // Compiler flags that change the emitted bytecode; keys the chunk cache
+    // and stamps .hexb files.
+    [[nodiscard]] uint8_t compile_options() const;
+    // Compiles source once; later calls with the same source and options
+    // return the cached chunk. Null on a compile error.
+    [[nodiscard]] CompiledScript prepare(std::string_view source);
+    InterpretResult execute(const ChunkView &chunk);
+    // Runs chunk once per row over columnar inputs: columns[k] holds $k for
+    // every row, and row i's result goes to results[i]. Stack chunks execute
+    // each instruction over a tile of rows at once; register chunks and
+    // instrumented runs go row by row. The two paths agree bit for bit except
+    // on NaN results, whose sign and payload may differ. A row that fails
+    // stops the batch with its error: results for it and every later row are
+    // left untouched.
+    InterpretResult execute_batch(const ChunkView &chunk, std::span<const double* const> columns, size_t rows,
+                                  double* results);
+    InterpretResult interpret(std::string_view source);
+    InterpretResult interpret(std::istream &stream);
+    // Run mChunk from ip in the loop specialized for the enabled instrumentation.
     InterpretResult run();
+    InterpretResult run_registers();
     void push(Value value);
     Value pop();
-};
-
-inline VM vm;
\ No newline at end of file
+};
\ No newline at end of file
@@ -0,0 +1,75 @@
+﻿#include "work_pool.h"
+
+#include <algorithm>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// The unclaimed indices [begin, end) of one worker. Padded to a cache line so
+// workers taking from their own slice do not contend on each other's.
+struct alignas(64) WorkSlice {
+    std::mutex mutex;
+    size_t begin = 0;
+    size_t end = 0;
+
+    bool take(size_t* index) {
+        std::lock_guard lock(mutex);
+        if (begin == end) return false;
+        *index = begin++;
+        return true;
+    }
+
+    // moves the back half of this slice into thief, returning false if empty
+    bool steal_into(WorkSlice &thief) {
+        size_t stolenBegin;
+        size_t stolenEnd;
+        {
+            std::lock_guard lock(mutex);
+            if (begin == end) return false;
+            stolenEnd = end;
+            stolenBegin = begin + (end - begin) / 2;
+            end = stolenBegin;
+        }
+        std::lock_guard lock(thief.mutex);
+        thief.begin = stolenBegin;
+        thief.end = stolenEnd;
+        return true;
+    }
+};
+
+// Work only ever moves between slices, never appears, so a worker that finds
+// every slice empty can stop: anything a thief is still moving will be run by
+// that thief.
+static void work(const int self, std::vector<WorkSlice> &slices,
+                 const std::function<void(int worker, size_t index)> &task) {
+    const int workers = static_cast<int>(slices.size());
+    for (;;) {
+        size_t index;
+        while (slices[self].take(&index))
+            task(self, index);
+
+        bool stole = false;
+        for (int offset = 1; offset < workers && !stole; ++offset)
+            stole = slices[(self + offset) % workers].steal_into(slices[self]);
+        if (!stole) return;
+    }
+}
+
+void run_work_stealing(const size_t count, int workers, const std::function<void(int worker, size_t index)> &task) {
+    workers = std::max(1, std::min(workers, static_cast<int>(std::max<size_t>(count, 1))));
+
+    std::vector<WorkSlice> slices(workers);
+    for (int i = 0; i < workers; ++i) {
+        slices[i].begin = count * i / workers;
+        slices[i].end = count * (i + 1) / workers;
+    }
+
+    std::vector<std::thread> threads;
+    threads.reserve(workers - 1);
+    for (int i = 1; i < workers; ++i)
+        threads.emplace_back(work, i, std::ref(slices), std::cref(task));
+    work(0, slices, task);
+
+    for (auto &thread : threads)
+        thread.join();
+}
@@ -0,0 +1,13 @@
+﻿#pragma once
+
+#include <functional>
+
+#include "common.h"
+
+// Calls task(worker, index) once for every index in [0, count) on `workers`
+// threads, worker being in [0, workers) so callers can keep per-thread state.
+// Each worker starts with an equal contiguous slice and takes indices from
+// its front; a worker that runs dry steals the back half of another worker's
+// remaining slice, so a few slow tasks do not leave the other threads idle.
+// Returns once every task has finished.
+void run_work_stealing(size_t count, int workers, const std::function<void(int worker, size_t index)> &task);